@@ -1,5 +1,8 @@
 #include "apu.h"
+#include "audio_out.h"
 #include "gb.h"
+#include "simd.h"
+#include "string.h"
 
 static const bool WAVEFORMS[4][8] = {{0, 0, 0, 0, 0, 0, 0, 1},
                                      {1, 0, 0, 0, 0, 0, 0, 1},
@@ -11,7 +14,7 @@ static u8 ch1_get_sample(GameBoy* gb) {
         gb->ch1_timer = gb->ch1_period;
         gb->ch1_index = (gb->ch1_index + 1) & 7;
     }
-    return WAVEFORMS[gb->ch1_duty][gb->ch1_index] ? gb->ch1_env_init : 0;
+    return WAVEFORMS[gb->ch1_duty][gb->ch1_index] ? gb->ch1_env_vol : 0;
 }
 
 static u8 ch2_get_sample(GameBoy* gb) {
@@ -19,58 +22,279 @@ static u8 ch2_get_sample(GameBoy* gb) {
         gb->ch2_timer = gb->ch2_period;
         gb->ch2_index = (gb->ch2_index + 1) & 7;
     }
-    return WAVEFORMS[gb->ch2_duty][gb->ch2_index] ? gb->ch2_env_init : 0;
+    return WAVEFORMS[gb->ch2_duty][gb->ch2_index] ? gb->ch2_env_vol : 0;
 }
 
-static u8 ch3_get_sample(GameBoy* gb) {
-    if (!gb->ch3_timer--) {
-        gb->ch3_timer = gb->ch3_period;
-        gb->ch3_index = (gb->ch3_index + 1) & 31;
+// Clock the noise LFSR once: XNOR the low two bits into bit 15, and bit 7
+// too in 7-bit mode, then shift right
+static u16 lfsr_step(u16 lfsr, bool width) {
+    u16 bit = (lfsr & 1) == (lfsr >> 1 & 1);
+    lfsr = (lfsr & 0x7FFF) | bit << 15;
+    if (width) {
+        lfsr = (lfsr & 0xFF7F) | bit << 7;
     }
-    u8 sample = gb->wave_ram[gb->ch3_index];
-    if (gb->ch3_vol == 3) {
-        sample >>= 2;
-    } else if (gb->ch3_vol == 2) {
-        sample >>= 1;
-    } else if (gb->ch3_vol == 0) {
-        sample = 0;
+    return lfsr >> 1;
+}
+
+// Clock the LFSR 8 times at once. Each new bit is the XNOR of two
+// neighboring bits. In 15-bit mode those all come from the low 9 bits, and
+// the 8 new bits land in bits 7-14. In 7-bit mode the last two new bits
+// depend on the first ones, and the low 7 bits decide the whole next state.
+static u16 lfsr_step8(u16 lfsr, bool width) {
+    if (width) {
+        u16 seq = lfsr & 0x7F;
+        u16 bits = ~(seq ^ seq >> 1) & 0x3F;
+        seq |= bits << 7;
+        bits |= (~(seq >> 6 ^ seq >> 7) & 3) << 6;
+        return bits >> 1 | bits << 7;
+    }
+    return lfsr >> 8 | (~(lfsr ^ lfsr >> 1) & 0xFF) << 7;
+}
+
+// Bit n is the output (bit 0) after the LFSR is clocked n + 1 more times.
+// Those are bits 1-8 of the state, except that in 7-bit mode the last two
+// are new bits, found in bits 7-8 of the state 8 clocks later.
+static u8 lfsr_outputs(u16 lfsr, u16 next, bool width) {
+    if (width) {
+        return (lfsr >> 1 & 0x3F) | (next >> 7 & 3) << 6;
+    }
+    return lfsr >> 1;
+}
+
+// Samples are made in blocks, one channel at a time, then mixed
+#define MIX_BLOCK 256
+
+// Channel DAC outputs range from -15 to 15, summed over 4 channels and
+// scaled by NR50 volumes of up to 8 they still fit an s16 after MIX_SCALE
+#define MIX_SCALE 68
+
+// High-pass filter charge factor per M-cycle: 0.999958 per T-cycle, as on
+// the DMG, to the power of 4
+#define HPF_CHARGE 0.999832f
+
+// Fill out with count DAC outputs of one channel. The DAC maps digital 0 to
+// 15 onto 15 to -15, or outputs nothing while it is off.
+static void render_channel(GameBoy* gb, u8 (*get_sample)(GameBoy*),
+                           bool active, bool dac, s16* out, size_t count) {
+    if (!dac) {
+        memset(out, 0, count * sizeof(*out));
+    } else if (!active) {
+        for (size_t i = 0; i < count; i++) {
+            out[i] = 15;
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            out[i] = 15 - 2 * get_sample(gb);
+        }
+    }
+}
+
+// Channel 3's timer runs at twice the M-cycle rate. Instead of stepping it
+// twice per sample, count the half M-cycles left before the next wave
+// sample and jump over whole periods at once.
+static void render_ch3(GameBoy* gb, s16* out, size_t count) {
+    if (!gb->ch3_dac) {
+        memset(out, 0, count * sizeof(*out));
+        return;
+    }
+    if (!gb->ch3_active) {
+        for (size_t i = 0; i < count; i++) {
+            out[i] = 15;
+        }
+        return;
     }
-    return sample;
+
+    const s8* table = gb->ch3_dac_table[gb->ch3_vol];
+    s32 period = gb->ch3_period + 1;
+    s32 left = gb->ch3_timer + 1;
+    u8 index = gb->ch3_index;
+    for (size_t i = 0; i < count; i++) {
+        left -= 2;
+        if (left <= 0) {
+            s32 steps = -left / period + 1;
+            index = (index + steps) & 31;
+            left += steps * period;
+        }
+        out[i] = table[index];
+    }
+    gb->ch3_timer = left - 1;
+    gb->ch3_index = index;
 }
 
-static u8 ch4_get_sample(GameBoy* gb) {
-    if (!gb->ch4_timer--) {
-        gb->ch4_timer = gb->ch4_period;
-        // Clock LFSR
-        bool new_bit = (gb->ch4_lfsr & 1) == (gb->ch4_lfsr >> 1 & 1);
-        gb->ch4_lfsr =
-            new_bit ? (gb->ch4_lfsr | 0x8000) : (gb->ch4_lfsr & 0x7FFF);
-        if (gb->ch4_width) {
-            gb->ch4_lfsr =
-                new_bit ? (gb->ch4_lfsr | 0x0080) : (gb->ch4_lfsr & 0xFF7F);
+// Channel 4 reads the outputs of the next 8 LFSR clocks from one table
+// lookup, and is only brought to its exact state at the end of the block
+static void render_ch4(GameBoy* gb, s16* out, size_t count) {
+    if (!gb->ch4_dac) {
+        memset(out, 0, count * sizeof(*out));
+        return;
+    }
+    s16 high = 15 - 2 * gb->ch4_env_vol;
+    if (!gb->ch4_active || !gb->ch4_period) {
+        // A period of 0 stands for shifts 14 and 15, which stop the LFSR
+        s16 level = gb->ch4_active && (gb->ch4_lfsr & 1) ? high : 15;
+        for (size_t i = 0; i < count; i++) {
+            out[i] = level;
         }
-        gb->ch4_lfsr >>= 1;
+        return;
     }
-    return (gb->ch4_lfsr & 1) ? gb->ch4_env_init : 0;
+
+    bool width = gb->ch4_width;
+    u32 left = gb->ch4_timer + 1;
+    u16 lfsr = gb->ch4_lfsr;
+    u16 next = lfsr_step8(lfsr, width);
+    u8 outputs = lfsr_outputs(lfsr, next, width);
+    size_t clocks = 0; // Since lfsr
+    s16 level = (lfsr & 1) ? high : 15;
+    for (size_t i = 0; i < count; i++) {
+        if (!--left) {
+            left = gb->ch4_period;
+            level = (outputs >> clocks & 1) ? high : 15;
+            if (++clocks == 8) {
+                lfsr = next;
+                next = lfsr_step8(lfsr, width);
+                outputs = lfsr_outputs(lfsr, next, width);
+                clocks = 0;
+            }
+        }
+        out[i] = level;
+    }
+    for (; clocks; clocks--) {
+        lfsr = lfsr_step(lfsr, width);
+    }
+    gb->ch4_timer = left - 1;
+    gb->ch4_lfsr = lfsr;
 }
 
-void render_audio_sample(GameBoy* gb) {
-    u8 ch1_sample = gb->ch1_active ? ch1_get_sample(gb) : 0;
-    u8 ch2_sample = gb->ch2_active ? ch2_get_sample(gb) : 0;
-    u8 ch3_sample =
-        gb->ch3_active ? (ch3_get_sample(gb), ch3_get_sample(gb)) : 0;
-    u8 ch4_sample = gb->ch4_active ? ch4_get_sample(gb) : 0;
+// Route channels to one side (NR51) and scale by its volume (NR50)
+static void mix_side(s16 ch[4][MIX_BLOCK], const bool route[4], s16 gain,
+                     size_t count, s16* out) {
+    size_t i = 0;
+#if RONDO_SSE2
+    __m128i masks[4];
+    for (size_t c = 0; c < 4; c++) {
+        masks[c] = _mm_set1_epi16(route[c] ? -1 : 0);
+    }
+    __m128i gains = _mm_set1_epi16(gain);
+    for (; i < (count & ~(size_t)7); i += 8) {
+        __m128i sum = _mm_setzero_si128();
+        for (size_t c = 0; c < 4; c++) {
+            __m128i samples = _mm_loadu_si128((const __m128i*)(ch[c] + i));
+            sum = _mm_add_epi16(sum, _mm_and_si128(samples, masks[c]));
+        }
+        _mm_storeu_si128((__m128i*)(out + i), _mm_mullo_epi16(sum, gains));
+    }
+#endif
+    for (; i < count; i++) {
+        s16 sum = 0;
+        for (size_t c = 0; c < 4; c++) {
+            sum += route[c] ? ch[c][i] : 0;
+        }
+        out[i] = sum * gain;
+    }
+}
 
-    s16 converted =
-        0x7FFF - (ch1_sample + ch2_sample + ch3_sample + ch4_sample) * 0x444;
-    play_sample(converted, converted);
+// The output capacitors pass changes but block the DC offset of the DACs.
+// Each output sample depends on the previous one, so this runs per sample.
+static s16 high_pass(float* cap, s16 in) {
+    float out = in - *cap;
+    *cap = in - out * HPF_CHARGE;
+    // A full swing right after a full swing the other way overshoots
+    if (out > 32767) {
+        return 32767;
+    }
+    if (out < -32768) {
+        return -32768;
+    }
+    return (s16)out;
+}
+
+static void render_block(GameBoy* gb, size_t count) {
+    s16 ch[4][MIX_BLOCK];
+    render_channel(gb, ch1_get_sample, gb->ch1_active, gb->ch1_dac, ch[0],
+                   count);
+    render_channel(gb, ch2_get_sample, gb->ch2_active, gb->ch2_dac, ch[1],
+                   count);
+    render_ch3(gb, ch[2], count);
+    render_ch4(gb, ch[3], count);
+
+    const bool route_l[4] = {gb->ch1_l, gb->ch2_l, gb->ch3_l, gb->ch4_l};
+    const bool route_r[4] = {gb->ch1_r, gb->ch2_r, gb->ch3_r, gb->ch4_r};
+    s16 l[MIX_BLOCK], r[MIX_BLOCK];
+    mix_side(ch, route_l, (gb->vol_l + 1) * MIX_SCALE, count, l);
+    mix_side(ch, route_r, (gb->vol_r + 1) * MIX_SCALE, count, r);
+
+    for (size_t i = 0; i < count; i++) {
+        l[i] = high_pass(&gb->hpf_cap[0], l[i]);
+        r[i] = high_pass(&gb->hpf_cap[1], r[i]);
+    }
+    push_audio(gb->audio_out, l, r, count);
+#if RONDO_STATS
+    gb->stats.audio_samples += count;
+#endif
+}
+
+// Generate one sample per M-cycle up to gb->clock
+void sync_apu(GameBoy* gb) {
+    if (gb->apu_clock >= gb->clock) {
+        return;
+    }
+    // Games can't see the channels' waveform positions, only what the frame
+    // sequencer updates (NR52 status, lengths and sweep overflow), so with
+    // audio off no samples need to be made
+    if (!gb->apu_en || gb->no_audio) {
+        gb->apu_clock = gb->clock;
+        return;
+    }
+#if RONDO_STATS
+    u64 start = get_time_ns();
+#endif
+    while (gb->apu_clock < gb->clock) {
+        u64 count = (gb->clock - gb->apu_clock) / 4;
+        if (count > MIX_BLOCK) {
+            count = MIX_BLOCK;
+        }
+        render_block(gb, count);
+        gb->apu_clock += count * 4;
+    }
+#if RONDO_STATS
+    gb->stats.apu_ns += get_time_ns() - start;
+#endif
+}
+
+// Envelope and sweep timers count periods of 0 as 8
+#define START_ENVELOPE(c)                                                      \
+    {                                                                          \
+        gb->ch##c##_env_vol = gb->ch##c##_env_init;                            \
+        gb->ch##c##_env_timer =                                                \
+            gb->ch##c##_env_sweep ? gb->ch##c##_env_sweep : 8;                 \
+    }
+
+// Return the next CH1 sweep frequency, disabling the channel if it
+// overflows 11 bits
+static u16 ch1_sweep_calc(GameBoy* gb) {
+    u16 delta = gb->ch1_sweep_freq >> gb->ch1_sweep_shift;
+    u16 freq = gb->ch1_sweep_dir ? gb->ch1_sweep_freq - delta
+                                 : gb->ch1_sweep_freq + delta;
+    if (freq > 0x7FF) {
+        gb->ch1_active = false;
+    }
+    return freq;
 }
 
 void ch1_trigger(GameBoy* gb) {
     if (gb->ch1_dac) {
         gb->ch1_active = true;
         if (!gb->ch1_len_ctr) {
-            gb->ch1_len_ctr = gb->ch1_len;
+            gb->ch1_len_ctr = 64;
+        }
+        START_ENVELOPE(1);
+
+        gb->ch1_sweep_freq = 0x7FF - gb->ch1_period;
+        gb->ch1_sweep_timer = gb->ch1_sweep_time ? gb->ch1_sweep_time : 8;
+        gb->ch1_sweep_en = gb->ch1_sweep_time || gb->ch1_sweep_shift;
+        if (gb->ch1_sweep_shift) {
+            // Only checks for overflow
+            ch1_sweep_calc(gb);
         }
     }
 }
@@ -79,8 +303,9 @@ void ch2_trigger(GameBoy* gb) {
     if (gb->ch2_dac) {
         gb->ch2_active = true;
         if (!gb->ch2_len_ctr) {
-            gb->ch2_len_ctr = gb->ch2_len;
+            gb->ch2_len_ctr = 64;
         }
+        START_ENVELOPE(2);
     }
 }
 
@@ -88,7 +313,20 @@ void ch3_trigger(GameBoy* gb) {
     if (gb->ch3_dac) {
         gb->ch3_active = true;
         if (!gb->ch3_len_ctr) {
-            gb->ch3_len_ctr = gb->ch3_len;
+            gb->ch3_len_ctr = 256;
+        }
+    }
+}
+
+// NR32 volumes 0-3 are mute, 100%, 50% and 25%
+void write_wave_ram(GameBoy* gb, u8 index, u8 data) {
+    static const u8 SHIFTS[4] = {4, 0, 1, 2};
+    gb->wave_ram[index] = data;
+    u8 samples[2] = {data >> 4, data & 0xF};
+    for (size_t vol = 0; vol < 4; vol++) {
+        for (size_t i = 0; i < 2; i++) {
+            gb->ch3_dac_table[vol][2 * index + i] =
+                15 - 2 * (samples[i] >> SHIFTS[vol]);
         }
     }
 }
@@ -98,44 +336,86 @@ void ch4_trigger(GameBoy* gb) {
         gb->ch4_active = true;
         gb->ch4_lfsr = 0;
         if (!gb->ch4_len_ctr) {
-            gb->ch4_len_ctr = gb->ch4_len;
+            gb->ch4_len_ctr = 64;
         }
+        START_ENVELOPE(4);
     }
 }
 
+// In M-cycles, 8 T-cycles for a divider of 0, else 16 per step, doubled
+// for each step of shift
 void update_ch4_period(GameBoy* gb) {
-    u32 period = gb->ch4_divider << 2;
-    if (period == 0) {
-        period = 2;
+    if (gb->ch4_shift >= 14) {
+        gb->ch4_period = 0;
+        return;
     }
-    period << gb->ch4_shift;
-    gb->ch4_period = period;
+    u32 period = gb->ch4_divider ? gb->ch4_divider * 4 : 2;
+    gb->ch4_period = period << gb->ch4_shift;
 }
 
+// A length of 0 means the counter already expired, triggering reloads it
 #define UPDATE_LENGTH(c)                                                       \
     {                                                                          \
-        if (gb->ch##c##_active && gb->ch##c##_len_en) {                        \
-            gb->ch##c##_len_ctr++;                                             \
+        if (gb->ch##c##_len_en && gb->ch##c##_len_ctr) {                       \
+            gb->ch##c##_len_ctr--;                                             \
             if (!gb->ch##c##_len_ctr) {                                        \
                 gb->ch##c##_active = false;                                    \
             }                                                                  \
         }                                                                      \
     }
 
-void div_apu_event(GameBoy* gb) {
-    gb->div_apu_counter++;
-    gb->div_apu_counter &= 7;
-    if (!(gb->div_apu_counter & 7)) {
-        // Envelope sweep
+// Step the volume towards 0 or 15 every ch*_env_sweep steps
+#define UPDATE_ENVELOPE(c)                                                     \
+    {                                                                          \
+        if (gb->ch##c##_active && gb->ch##c##_env_sweep &&                     \
+            !--gb->ch##c##_env_timer) {                                        \
+            gb->ch##c##_env_timer = gb->ch##c##_env_sweep;                     \
+            if (gb->ch##c##_env_dir && gb->ch##c##_env_vol < 15) {             \
+                gb->ch##c##_env_vol++;                                         \
+            } else if (!gb->ch##c##_env_dir && gb->ch##c##_env_vol > 0) {      \
+                gb->ch##c##_env_vol--;                                         \
+            }                                                                  \
+        }                                                                      \
+    }
+
+static void update_sweep(GameBoy* gb) {
+    if (--gb->ch1_sweep_timer) {
+        return;
     }
-    if (!(gb->div_apu_counter & 3)) {
-        // CH1 freq sweep
+    gb->ch1_sweep_timer = gb->ch1_sweep_time ? gb->ch1_sweep_time : 8;
+    if (!gb->ch1_active || !gb->ch1_sweep_en || !gb->ch1_sweep_time) {
+        return;
     }
-    if (!(gb->div_apu_counter & 1)) {
-        // Sound length
+
+    u16 freq = ch1_sweep_calc(gb);
+    if (freq <= 0x7FF && gb->ch1_sweep_shift) {
+        gb->ch1_sweep_freq = freq;
+        gb->ch1_period = 0x7FF - freq;
+        // The new frequency is checked for overflow again, but not kept
+        ch1_sweep_calc(gb);
+    }
+}
+
+// Frame sequencer, stepped at 512 Hz. Lengths are clocked on even steps,
+// the CH1 sweep on steps 2 and 6, and envelopes on step 7.
+void div_apu_event(GameBoy* gb) {
+    // Samples up to now use the old lengths, envelopes and sweep
+    sync_apu(gb);
+
+    u8 step = gb->div_apu_counter;
+    gb->div_apu_counter = (step + 1) & 7;
+    if (!(step & 1)) {
         UPDATE_LENGTH(1);
         UPDATE_LENGTH(2);
         UPDATE_LENGTH(3);
         UPDATE_LENGTH(4);
     }
+    if ((step & 3) == 2) {
+        update_sweep(gb);
+    }
+    if (step == 7) {
+        UPDATE_ENVELOPE(1);
+        UPDATE_ENVELOPE(2);
+        UPDATE_ENVELOPE(4);
+    }
 }
@@ -1,12 +1,19 @@
 #ifndef RONDO_APU_H
 #define RONDO_APU_H
 
-void render_audio_sample(struct GameBoy* gb);
+#include "gb.h"
+
+// The APU is not run every cycle. It catches up in bursts when its registers
+// or wave RAM are accessed, before frame sequencer steps and at the end of
+// each frame.
+void sync_apu(struct GameBoy* gb);
 void ch1_trigger(struct GameBoy* gb);
 void ch2_trigger(struct GameBoy* gb);
 void ch3_trigger(struct GameBoy* gb);
 void ch4_trigger(struct GameBoy* gb);
 void update_ch4_period(struct GameBoy* gb);
+// Store a byte of wave RAM (index 0-15) and update ch3_dac_table
+void write_wave_ram(struct GameBoy* gb, u8 index, u8 data);
 void div_apu_event(struct GameBoy* gb);
 
 #endif
@@ -0,0 +1,132 @@
+#include "audio_out.h"
+
+#include "string.h"
+
+// MSVC only has stdatomic.h with /experimental:c11atomics. Its Interlocked
+// operations are full barriers, stronger than needed, but they only run once
+// per block.
+#if defined(_MSC_VER) && !defined(__clang__)
+#include "intrin.h"
+
+typedef volatile long AtomicU32;
+
+static void store_index(AtomicU32* p, u32 value) {
+    _InterlockedExchange(p, (long)value);
+}
+
+static u32 load_index(AtomicU32* p) { return (u32)_InterlockedOr(p, 0); }
+#else
+#include "stdatomic.h"
+
+typedef atomic_uint AtomicU32;
+
+static void store_index(AtomicU32* p, u32 value) {
+    atomic_store_explicit(p, value, memory_order_release);
+}
+
+static u32 load_index(AtomicU32* p) {
+    return atomic_load_explicit(p, memory_order_acquire);
+}
+#endif
+
+// head and tail wrap around, which AUDIO_RING_FRAMES being a power of two
+// makes harmless
+struct AudioOut {
+    AtomicU32 head; // Frames pushed, only written by the producer
+    AtomicU32 tail; // Frames popped, only written by the consumer
+
+    // Input samples per output frame, 16.16 fixed point. Set by the consumer.
+    AtomicU32 step;
+
+    // Producer side resampler state
+    u32 phase; // Input samples taken towards the next frame, 16.16
+    s32 sum[2];
+    u32 taken;
+    u64 dropped; // Frames lost to a full ring
+
+    s16 ring[AUDIO_RING_FRAMES][2];
+};
+
+_Static_assert(sizeof(AudioOut) <= AUDIO_OUT_SIZE,
+               "AUDIO_OUT_SIZE is too small for AudioOut");
+
+// The APU's sample rate, one per M-cycle
+#define AUDIO_IN_RATE 1048576.0
+
+static u32 audio_step(double ratio) {
+    return (u32)(AUDIO_IN_RATE / AUDIO_OUT_RATE / ratio * 65536 + 0.5);
+}
+
+void init_audio_out(AudioOut* out) {
+    // The ring itself needs no clearing, it is read only once pushed
+    store_index(&out->head, 0);
+    store_index(&out->tail, 0);
+    store_index(&out->step, audio_step(1));
+    out->phase = 0;
+    out->sum[0] = out->sum[1] = 0;
+    out->taken = 0;
+    out->dropped = 0;
+}
+
+void push_audio(AudioOut* out, const s16* l, const s16* r, size_t count) {
+    u32 step = load_index(&out->step);
+    u32 head = load_index(&out->head);
+    u32 tail = load_index(&out->tail);
+
+    for (size_t i = 0; i < count; i++) {
+        out->sum[0] += l[i];
+        out->sum[1] += r[i];
+        out->taken++;
+        out->phase += 1 << 16;
+        if (out->phase < step) {
+            continue;
+        }
+        out->phase -= step;
+        if (head - tail == AUDIO_RING_FRAMES) {
+            // Check again, the consumer may have made room since
+            tail = load_index(&out->tail);
+        }
+        if (head - tail < AUDIO_RING_FRAMES) {
+            s16* frame = out->ring[head % AUDIO_RING_FRAMES];
+            frame[0] = (s16)(out->sum[0] / (s32)out->taken);
+            frame[1] = (s16)(out->sum[1] / (s32)out->taken);
+            head++;
+        } else {
+            out->dropped++;
+        }
+        out->sum[0] = out->sum[1] = 0;
+        out->taken = 0;
+    }
+    store_index(&out->head, head);
+}
+
+size_t pop_audio(AudioOut* out, s16* frames, size_t max) {
+    u32 tail = load_index(&out->tail);
+    u32 head = load_index(&out->head);
+    size_t count = head - tail < max ? head - tail : max;
+
+    // Copy in at most two runs, split where the ring wraps
+    size_t start = tail % AUDIO_RING_FRAMES;
+    size_t first = AUDIO_RING_FRAMES - start;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(frames, out->ring[start], first * sizeof(out->ring[0]));
+    memcpy(frames + 2 * first, out->ring[0],
+           (count - first) * sizeof(out->ring[0]));
+    store_index(&out->tail, tail + (u32)count);
+    return count;
+}
+
+void set_audio_fill(AudioOut* out, unsigned percent) {
+    if (percent > 100) {
+        percent = 100;
+    }
+    double fill = percent / 100.0;
+    double ratio = 1 + AUDIO_MAX_SKEW * (1 - 2 * fill);
+    store_index(&out->step, audio_step(ratio));
+}
+
+void reset_audio_rate(AudioOut* out) {
+    store_index(&out->step, audio_step(1));
+}
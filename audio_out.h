@@ -0,0 +1,40 @@
+#ifndef RONDO_AUDIO_OUT_H
+#define RONDO_AUDIO_OUT_H
+
+#include "gb.h"
+
+// The APU makes one stereo sample per M-cycle, about 1 MHz. Rather than hand
+// that to the frontend, the samples are box-filtered down to AUDIO_OUT_RATE
+// and queued in a lock-free ring with a single producer (the emulation
+// thread, in sync_apu()) and a single consumer (whoever feeds the frontend).
+//
+// The frontend's buffer fill can be reported with set_audio_fill(). Below
+// half full the resampler makes slightly more frames, above it slightly
+// fewer, by at most AUDIO_MAX_SKEW. That keeps audio sync on displays that
+// aren't 59.73 Hz from stuttering or piling up latency.
+
+#define AUDIO_OUT_RATE 48000
+#define AUDIO_MAX_SKEW 0.005
+// Stereo frames, a power of two. About 5 emulated frames' worth.
+#define AUDIO_RING_FRAMES 4096
+
+// Opaque, so that only audio_out.c depends on how atomics are done. Its
+// owner reserves AUDIO_OUT_SIZE bytes for it.
+typedef struct AudioOut AudioOut;
+#define AUDIO_OUT_SIZE (AUDIO_RING_FRAMES * 4 + 64)
+
+// Start empty at the nominal rate. out points to AUDIO_OUT_SIZE bytes
+// aligned for a u64, in gb's case inside the instance arena.
+void init_audio_out(AudioOut* out);
+
+// Producer: resample count samples of left and right APU output
+void push_audio(AudioOut* out, const s16* l, const s16* r, size_t count);
+// Consumer: copy up to max interleaved stereo frames, return how many
+size_t pop_audio(AudioOut* out, s16* frames, size_t max);
+
+// Consumer: the frontend's buffer is percent full (0-100)
+void set_audio_fill(AudioOut* out, unsigned percent);
+// Consumer: go back to the nominal rate, for when fill isn't reported
+void reset_audio_rate(AudioOut* out);
+
+#endif
@@ -1,6 +1,7 @@
 #include "cpu.h"
 
 #include "gb.h"
+#include "profile.h"
 #include "stdio.h"
 #include "stdlib.h"
 
@@ -750,6 +751,9 @@ OpFuncPtr cb_ptrs[] = {
 
 static void op_cb(GameBoy* gb) {
     u8 opcode = read_imm_cycle(gb);
+#if RONDO_PROFILE
+    gb->prof->cb_opcode = opcode;
+#endif
     OpFuncPtr func = cb_ptrs[opcode];
     func(gb);
 }
@@ -800,6 +804,10 @@ OpFuncPtr op_ptrs[] = {
 // clang-format on
 
 void run_opcode(GameBoy* gb) {
+#if RONDO_PROFILE
+    u64 start_cycles = gb->prof->cycles;
+#endif
+
     // Handle interrupts
     if (gb->ime && (gb->ie & gb->if_)) {
         // At least one pending interrupt
@@ -830,10 +838,21 @@ void run_opcode(GameBoy* gb) {
         }
         cycle(gb);
 
+#if RONDO_PROFILE
+        prof_record_irq(gb, gb->prof->cycles - start_cycles);
+#endif
         return;
     }
 
+#if RONDO_PROFILE
+    u16 pc = gb->pc;
+#endif
     u8 opcode = read_imm_cycle(gb);
     OpFuncPtr func = op_ptrs[opcode];
     func(gb);
+    COUNT_STAT(gb, instructions);
+
+#if RONDO_PROFILE
+    prof_record(gb, pc, opcode, gb->prof->cycles - start_cycles);
+#endif
 }
@@ -0,0 +1,255 @@
+#include "fbuf.h"
+
+#include "render_thread.h"
+#include "simd.h"
+#include "string.h"
+#include "tile.h"
+#include "video_log.h"
+
+const u32 colors[4] = {0xFFFFFF, 0xAAAAAA, 0x555555, 0x000000};
+const u16 colors_rgb565[4] = {0xFFFF, 0xAD55, 0x52AA, 0x0000};
+
+size_t fbuf_pitch(FBufFormat format) {
+    switch (format) {
+    case FBUF_XRGB8888:
+        return SCREEN_WIDTH * sizeof(u32);
+    case FBUF_RGB565:
+        return SCREEN_WIDTH * sizeof(u16);
+    case FBUF_INDEXED8:
+        return SCREEN_WIDTH;
+    case FBUF_PACKED2:
+        return SCREEN_WIDTH / 4;
+    }
+    return 0;
+}
+
+size_t fbuf_size(FBufFormat format) {
+    return fbuf_pitch(format) * SCREEN_HEIGHT;
+}
+
+void set_fbuf_format(GameBoy* gb, FBufFormat format) {
+    // Both replays draw in the format they were started with. Stopping the
+    // render thread also puts gb->fbuf back in the arena.
+    bool threaded = gb->render_thread;
+    bool deferred = gb->deferred_video;
+    stop_render_thread(gb);
+    stop_deferred_video(gb);
+    memset(gb->fbuf, 0, fbuf_size(format));
+    gb->fbuf_format = format;
+    update_pal_lut(gb);
+    if (threaded) {
+        start_render_thread(gb);
+    }
+    if (deferred) {
+        start_deferred_video(gb);
+    }
+}
+
+u32 fbuf_pixel(FBufFormat format, u8 shade) {
+    switch (format) {
+    case FBUF_XRGB8888:
+        return colors[shade];
+    case FBUF_RGB565:
+        return colors_rgb565[shade];
+    default:
+        // Indexed formats store the shade itself
+        return shade;
+    }
+}
+
+void update_pal_lut(GameBoy* gb) {
+    const u8* pals[4] = {gb->bgp, gb->obp0, gb->obp1, (const u8[4]){0}};
+    for (size_t pal = 0; pal < 4; pal++) {
+        for (size_t color = 0; color < 4; color++) {
+            gb->pal_lut[PAL_CODE(pal, color)] =
+                fbuf_pixel(gb->fbuf_format, pals[pal][color]);
+        }
+    }
+}
+
+static void expand_indexed8_xrgb8888(const u8* src, u32* dst, size_t count) {
+    size_t i = 0;
+#if RONDO_SSE2
+    // Select each output pixel with one compare per shade, 16 pixels per step
+    const __m128i zero = _mm_setzero_si128();
+    __m128i shades[4], palette[4];
+    for (int s = 0; s < 4; s++) {
+        shades[s] = _mm_set1_epi32(s);
+        palette[s] = _mm_set1_epi32((int)colors[s]);
+    }
+    for (; i < (count & ~(size_t)15); i += 16) {
+        __m128i idx = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i lo = _mm_unpacklo_epi8(idx, zero);
+        __m128i hi = _mm_unpackhi_epi8(idx, zero);
+        __m128i quads[4] = {
+            _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+            _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)};
+        for (int q = 0; q < 4; q++) {
+            __m128i out = zero;
+            for (int s = 0; s < 4; s++) {
+                __m128i mask = _mm_cmpeq_epi32(quads[q], shades[s]);
+                out = _mm_or_si128(out, _mm_and_si128(mask, palette[s]));
+            }
+            _mm_storeu_si128((__m128i*)(dst + i + 4 * q), out);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = colors[src[i] & 3];
+    }
+}
+
+static void expand_indexed8_rgb565(const u8* src, u16* dst, size_t count) {
+    size_t i = 0;
+#if RONDO_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    __m128i shades[4], palette[4];
+    for (int s = 0; s < 4; s++) {
+        shades[s] = _mm_set1_epi16(s);
+        palette[s] = _mm_set1_epi16((short)colors_rgb565[s]);
+    }
+    for (; i < (count & ~(size_t)15); i += 16) {
+        __m128i idx = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i halves[2] = {_mm_unpacklo_epi8(idx, zero),
+                             _mm_unpackhi_epi8(idx, zero)};
+        for (int h = 0; h < 2; h++) {
+            __m128i out = zero;
+            for (int s = 0; s < 4; s++) {
+                __m128i mask = _mm_cmpeq_epi16(halves[h], shades[s]);
+                out = _mm_or_si128(out, _mm_and_si128(mask, palette[s]));
+            }
+            _mm_storeu_si128((__m128i*)(dst + i + 8 * h), out);
+        }
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = colors_rgb565[src[i] & 3];
+    }
+}
+
+// Packed bytes go through a table of four output pixels per input byte
+static void expand_packed2_xrgb8888(const u8* src, u32* dst, size_t count) {
+    u32 table[256][4];
+    for (size_t b = 0; b < 256; b++) {
+        for (size_t p = 0; p < 4; p++) {
+            table[b][p] = colors[(b >> (2 * p)) & 3];
+        }
+    }
+    for (size_t i = 0; i < count / 4; i++) {
+        memcpy(dst + 4 * i, table[src[i]], sizeof(table[0]));
+    }
+}
+
+static void expand_packed2_rgb565(const u8* src, u16* dst, size_t count) {
+    u16 table[256][4];
+    for (size_t b = 0; b < 256; b++) {
+        for (size_t p = 0; p < 4; p++) {
+            table[b][p] = colors_rgb565[(b >> (2 * p)) & 3];
+        }
+    }
+    for (size_t i = 0; i < count / 4; i++) {
+        memcpy(dst + 4 * i, table[src[i]], sizeof(table[0]));
+    }
+}
+
+// Direct framebuffers only ever hold the four shade colors, so converting
+// between them maps each pixel back to its shade. X bits are ignored.
+static void convert_xrgb8888_rgb565(const u32* src, u16* dst, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        u8 shade = 3;
+        for (u8 s = 0; s < 3; s++) {
+            if ((src[i] & 0xFFFFFF) == colors[s]) {
+                shade = s;
+            }
+        }
+        dst[i] = colors_rgb565[shade];
+    }
+}
+
+static void convert_rgb565_xrgb8888(const u16* src, u32* dst, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        u8 shade = 3;
+        for (u8 s = 0; s < 3; s++) {
+            if (src[i] == colors_rgb565[s]) {
+                shade = s;
+            }
+        }
+        dst[i] = colors[shade];
+    }
+}
+
+// One line writer per direct color type, so the loop over pixels is
+// specialized for its pixel size and the format is only checked per line
+#define DEFINE_WRITE_LINE(NAME, TYPE)                                          \
+    static void NAME(const u32* lut, const u8* codes, TYPE* row) {             \
+        for (size_t x = 0; x < SCREEN_WIDTH; x++) {                            \
+            row[x] = (TYPE)lut[codes[x]];                                      \
+        }                                                                      \
+    }
+
+DEFINE_WRITE_LINE(write_line_xrgb8888, u32)
+DEFINE_WRITE_LINE(write_line_rgb565, u16)
+
+void write_fbuf_line(void* fbuf, FBufFormat format, const u32* lut, u8 y,
+                     const u8* codes) {
+    u8* row = (u8*)fbuf + y * fbuf_pitch(format);
+    switch (format) {
+    case FBUF_XRGB8888:
+        write_line_xrgb8888(lut, codes, (u32*)row);
+        break;
+    case FBUF_RGB565:
+        write_line_rgb565(lut, codes, (u16*)row);
+        break;
+    case FBUF_INDEXED8: {
+        u8 shades[16];
+        for (size_t i = 0; i < 16; i++) {
+            shades[i] = (u8)lut[i];
+        }
+        get_tile_kernels()->apply_palette(codes, SCREEN_WIDTH, shades, row);
+        break;
+    }
+    case FBUF_PACKED2:
+        for (size_t i = 0; i < SCREEN_WIDTH / 4; i++) {
+            const u8* c = codes + 4 * i;
+            row[i] = lut[c[0]] | lut[c[1]] << 2 | lut[c[2]] << 4 |
+                     lut[c[3]] << 6;
+        }
+        break;
+    }
+}
+
+void expand_fbuf(GameBoy* gb, void* dst, FBufFormat out_format) {
+    const size_t count = SCREEN_WIDTH * SCREEN_HEIGHT;
+    bool to_rgb565 = out_format == FBUF_RGB565;
+
+    switch (gb->fbuf_format) {
+    case FBUF_INDEXED8:
+        if (to_rgb565) {
+            expand_indexed8_rgb565(gb->fbuf, dst, count);
+        } else {
+            expand_indexed8_xrgb8888(gb->fbuf, dst, count);
+        }
+        break;
+    case FBUF_PACKED2:
+        if (to_rgb565) {
+            expand_packed2_rgb565(gb->fbuf, dst, count);
+        } else {
+            expand_packed2_xrgb8888(gb->fbuf, dst, count);
+        }
+        break;
+    case FBUF_XRGB8888:
+        if (to_rgb565) {
+            convert_xrgb8888_rgb565(gb->fbuf, dst, count);
+        } else {
+            memcpy(dst, gb->fbuf, fbuf_size(FBUF_XRGB8888));
+        }
+        break;
+    case FBUF_RGB565:
+        if (to_rgb565) {
+            memcpy(dst, gb->fbuf, fbuf_size(FBUF_RGB565));
+        } else {
+            convert_rgb565_xrgb8888(gb->fbuf, dst, count);
+        }
+        break;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef RONDO_FBUF_H
+#define RONDO_FBUF_H
+
+#include "gb.h"
+
+// Shades 0-3 as XRGB8888, indexed framebuffers store indices into this
+extern const u32 colors[4];
+extern const u16 colors_rgb565[4];
+
+// Bytes per row and in total for a framebuffer in the given format
+size_t fbuf_pitch(FBufFormat format);
+size_t fbuf_size(FBufFormat format);
+// The largest fbuf_size(), for FBUF_XRGB8888
+#define FBUF_MAX_SIZE (SCREEN_WIDTH * SCREEN_HEIGHT * 4)
+
+// gb->fbuf has room for any format. Switching clears it.
+void set_fbuf_format(GameBoy* gb, FBufFormat format);
+
+// Shade 0-3 as a pixel in the given format
+u32 fbuf_pixel(FBufFormat format, u8 shade);
+
+// Rebuild gb->pal_lut from the palette registers and gb->fbuf_format
+void update_pal_lut(GameBoy* gb);
+
+// Store line y of PAL_CODE() pixels into fbuf, mapped through lut
+void write_fbuf_line(void* fbuf, FBufFormat format, const u32* lut, u8 y,
+                     const u8* codes);
+
+// Convert gb->fbuf, in any format, into out_format, which must be
+// FBUF_XRGB8888 or FBUF_RGB565. dst must hold fbuf_size(out_format) bytes. A
+// framebuffer that is already in out_format is copied as-is, one in the other
+// direct format is converted pixel by pixel.
+void expand_fbuf(GameBoy* gb, void* dst, FBufFormat out_format);
+
+#endif
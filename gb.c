@@ -1,10 +1,34 @@
+// For clock_gettime()
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include "gb.h"
 
 #include "apu.h"
+#include "audio_out.h"
 #include "cpu.h"
+#include "fbuf.h"
+#include "hash.h"
 #include "lcd.h"
+#include "profile.h"
+#include "render_thread.h"
+#include "stddef.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
+#include "tile.h"
+#include "time.h"
+#include "timer.h"
+#include "video_log.h"
+
+#ifdef _MSC_VER
+#include "malloc.h"
+#endif
+#if RONDO_STATS && defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include "windows.h"
+#endif
 
 // Critical memory allocation, abort on failure
 void* crit_alloc(size_t size) {
@@ -16,6 +40,109 @@ void* crit_alloc(size_t size) {
     return ptr;
 }
 
+// Layout of GameBoy, see the blocks in gb.h
+_Static_assert(offsetof(GameBoy, hram) + sizeof(u8*) <= 2 * GB_CACHE_LINE,
+               "Hot GameBoy fields spill past two cache lines");
+_Static_assert(offsetof(GBStats, writes) + sizeof(u64[REGION_COUNT]) <=
+                   3 * GB_CACHE_LINE,
+               "Hot GBStats counters spill past three cache lines");
+_Static_assert(offsetof(GameBoy, lcd_en) % GB_CACHE_LINE == 0 &&
+                   offsetof(GameBoy, type) % GB_CACHE_LINE == 0,
+               "GameBoy blocks must start on a cache line");
+#if RONDO_STATS
+_Static_assert(offsetof(GameBoy, stats) % GB_CACHE_LINE == 0,
+               "GBStats must start on a cache line");
+#endif
+_Static_assert(offsetof(GameBoy, stat_mode) < offsetof(GameBoy, lcd_en) +
+                                                  GB_CACHE_LINE,
+               "LCD stepping state must share LCDC's cache line");
+
+#define ARENA_PAGE 4096
+
+// Everything an instance owns, in one page-aligned allocation. Each region
+// sits at a fixed offset, so a whole instance can be copied at once, and the
+// large regions start on their own page. Only DMG sizes for now.
+//
+// The emulated state comes first and ends where fbuf starts, see fork_gb().
+typedef struct GBArena {
+    GameBoy gb;
+    u8 oam[0xA0];
+    u8 hram[0x7F];
+    _Alignas(ARENA_PAGE) u8 vram[0x2000];
+    u8 wram[0x2000];
+    u8 fbuf[FBUF_MAX_SIZE];
+    _Alignas(ARENA_PAGE) u8 audio_out[AUDIO_OUT_SIZE];
+} GBArena;
+
+_Static_assert(offsetof(GBArena, gb) == 0,
+               "A GameBoy pointer must also point to its arena");
+
+struct GBPool {
+    size_t max_free;
+    size_t count;
+    GBArena* arenas[]; // Free for reuse
+};
+
+// Contents are left over from earlier use if the arena comes from pool
+static GBArena* alloc_arena(GBPool* pool) {
+    if (pool && pool->count) {
+        return pool->arenas[--pool->count];
+    }
+#ifdef _MSC_VER
+    GBArena* arena = _aligned_malloc(sizeof(GBArena), ARENA_PAGE);
+#else
+    GBArena* arena = aligned_alloc(ARENA_PAGE, sizeof(GBArena));
+#endif
+    if (!arena) {
+        printf("Memory allocation failed!");
+        exit(1);
+    }
+    return arena;
+}
+
+static void release_arena(GBArena* arena) {
+#ifdef _MSC_VER
+    _aligned_free(arena);
+#else
+    free(arena);
+#endif
+}
+
+// Back to the instance's pool if it has room
+static void free_arena(GBArena* arena) {
+    GBPool* pool = arena->gb.pool;
+    if (pool && pool->count < pool->max_free) {
+        pool->arenas[pool->count++] = arena;
+    } else {
+        release_arena(arena);
+    }
+}
+
+GBPool* make_gb_pool(size_t max_free) {
+    GBPool* pool = crit_alloc(sizeof(GBPool) + max_free * sizeof(GBArena*));
+    pool->max_free = max_free;
+    return pool;
+}
+
+void destroy_gb_pool(GBPool* pool) {
+    for (size_t i = 0; i < pool->count; i++) {
+        release_arena(pool->arenas[i]);
+    }
+    free(pool);
+}
+
+// Point gb's memory map at its arena's regions
+static void link_arena(GBArena* arena) {
+    GameBoy* gb = &arena->gb;
+    gb->vram = arena->vram;
+    gb->wram_lo = arena->wram;
+    gb->wram_hi = arena->wram + 0x1000;
+    gb->oam = arena->oam;
+    gb->hram = arena->hram;
+    gb->fbuf = arena->fbuf;
+    gb->audio_out = (AudioOut*)arena->audio_out;
+}
+
 GameBoy* make_gb(u8* rom, size_t size) {
     if (size < 0x8000) {
         printf("File must be at least 0x8000 bytes\n");
@@ -45,16 +172,13 @@ GameBoy* make_gb(u8* rom, size_t size) {
         exit(1);
     } else {
         // Monochrome/Original Game Boy
-        gb = crit_alloc(sizeof(GameBoy));
+        GBArena* arena = alloc_arena(NULL);
+        memset(arena, 0, sizeof(GBArena));
+        link_arena(arena);
+        gb = &arena->gb;
         gb->type = DMG;
     }
 
-    gb->vram = crit_alloc(gb->type == CGB ? 0x4000 : 0x2000);
-    gb->wram_lo = crit_alloc(gb->type == CGB ? 0x8000 : 0x2000);
-    gb->wram_hi = gb->wram_lo + 0x1000;
-    gb->oam = crit_alloc(0xA0);
-    gb->hram = crit_alloc(0x7F);
-
     // Cartridge stuff
     if (rom[0x147] != 0x00) {
         printf("Only standard (no mapper) carts supported right now");
@@ -82,22 +206,90 @@ GameBoy* make_gb(u8* rom, size_t size) {
     gb->p1_get_btn = gb->p1_get_dpad = false;
 
     gb->lcd_en = true;
+    gb->dots = -80;
+    gb->stat_mode = MODE_OAM_SCAN;
+    hash_begin(&gb->line_hash);
+    init_timer(gb);
+    init_audio_out(gb->audio_out);
+    update_ch4_period(gb);
+    for (u8 i = 0; i < sizeof(gb->wave_ram); i++) {
+        write_wave_ram(gb, i, 0);
+    }
 
-    gb->fbuf = crit_alloc(SCREEN_HEIGHT * SCREEN_WIDTH * sizeof(u32));
+    set_fbuf_format(gb, FBUF_XRGB8888);
+    // Pick the SIMD kernels now rather than from the render path
+    get_tile_kernels();
+
+#if RONDO_PROFILE
+    gb->prof = prof_create();
+#endif
 
     return gb;
 }
 
 void destroy_gb(GameBoy* gb) {
-    free(gb->vram);
+    stop_render_thread(gb);
+    stop_deferred_video(gb);
     free(gb->cartram);
-    free(gb->wram_lo);
-    free(gb->oam);
-    free(gb->hram);
-    free(gb);
+#if RONDO_PROFILE
+    prof_destroy(gb->prof);
+#endif
+    free_arena((GBArena*)gb);
 }
 
+GameBoy* fork_gb(GameBoy* gb, GBPool* pool) {
+    // Only the state is copied. The framebuffer and audio ring pages aren't
+    // touched here, apart from clearing the part of fbuf in use.
+    GBArena* arena = alloc_arena(pool);
+    memcpy(arena, gb, offsetof(GBArena, fbuf));
+    link_arena(arena);
+
+    GameBoy* child = &arena->gb;
+    child->pool = pool;
+    // Cartridge RAM isn't emulated yet, there is nothing to copy
+    child->cartram = NULL;
+    child->video_log = NULL;
+    child->deferred_video = NULL;
+    child->render_thread = NULL;
+    memset(child->fbuf, 0, fbuf_size(child->fbuf_format));
+    init_audio_out(child->audio_out);
+#if RONDO_PROFILE
+    child->prof = prof_create();
+#endif
+    return child;
+}
+
+#if RONDO_STATS
+#ifdef _WIN32
+u64 get_time_ns(void) {
+    static LARGE_INTEGER freq;
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    // Split to keep the multiplication from overflowing
+    u64 secs = now.QuadPart / freq.QuadPart;
+    u64 rest = now.QuadPart % freq.QuadPart;
+    return secs * 1000000000 + rest * 1000000000 / freq.QuadPart;
+}
+#else
+u64 get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+const GBStats* get_stats(GameBoy* gb) { return &gb->stats; }
+
+void reset_stats(GameBoy* gb) { memset(&gb->stats, 0, sizeof(GBStats)); }
+#endif
+
 void run_frame(GameBoy* gb) {
+#if RONDO_STATS
+    u64 start = get_time_ns();
+#endif
     while (!gb->end_frame) {
         // if (gb->pc == 0x2E4) {
         //     printf("Reached\n");
@@ -105,16 +297,25 @@ void run_frame(GameBoy* gb) {
         // }
         run_opcode(gb);
     }
+    sync_apu(gb);
     gb->end_frame = false;
+#if RONDO_STATS
+    gb->stats.frames++;
+    gb->stats.frame_ns += get_time_ns() - start;
+#endif
 }
 
 u8 io_read(GameBoy* gb, u16 addr) {
     addr &= 0x7F;
+    COUNT_STAT(gb, io_reads[addr]);
+    if (addr >= 0x10 && addr <= 0x3F) {
+        // NR10-NR52 and wave RAM
+        sync_apu(gb);
+    }
 
     // Wave RAM
     if (addr >= 0x30 && addr <= 0x3f) {
-        u8 index = (addr - 0x30) * 2;
-        return gb->wave_ram[index] << 4 | gb->wave_ram[index + 1];
+        return gb->wave_ram[addr - 0x30];
     }
 
     switch (addr) {
@@ -126,9 +327,9 @@ u8 io_read(GameBoy* gb, u16 addr) {
     case 0x02: // SC (FF02)
         return gb->sc;
     case 0x04: // DIV (FF04)
-        return gb->div >> 8;
+        return read_div(gb);
     case 0x05: // TIMA (FF05)
-        return gb->tima;
+        return read_tima(gb);
     case 0x06: // TMA (FF06)
         return gb->tma;
     case 0x07: // TAC (FF07)
@@ -186,7 +387,9 @@ u8 io_read(GameBoy* gb, u16 addr) {
                (gb->tile_sel << 4) | (gb->bg_map << 3) | (gb->obj_size << 2) |
                (gb->obj_en << 1) | (gb->bg_en << 0);
     case 0x41: // STAT (FF41)
-        return gb->stat;
+        // The mode reads as 0 while the LCD is off
+        return 0x80 | gb->stat | ((gb->ly == gb->lyc) << 2) |
+               (gb->lcd_en ? gb->stat_mode : 0);
     case 0x42: // SCY (FF42)
         return gb->scy;
     case 0x43: // SCX (FF43)
@@ -221,12 +424,20 @@ u8 io_read(GameBoy* gb, u16 addr) {
 
 void io_write(GameBoy* gb, u16 addr, u8 data) {
     addr &= 0x7F;
+    COUNT_STAT(gb, io_writes[addr]);
+    if (addr >= 0x10 && addr <= 0x3F) {
+        // The APU runs with the old register values up to now
+        sync_apu(gb);
+    }
+
+    // LCD registers, DMA is logged as the OAM writes it makes
+    if (gb->video_log && addr >= 0x40 && addr <= 0x4B && addr != 0x46) {
+        log_video_write(gb, 0xFF00 | addr, data);
+    }
 
     // Wave RAM
     if (addr >= 0x30 && addr <= 0x3f) {
-        u8 index = (addr - 0x30) * 2;
-        gb->wave_ram[index] = GET_BITS(data, 4, 7);
-        gb->wave_ram[index + 1] = GET_BITS(data, 0, 3);
+        write_wave_ram(gb, addr - 0x30, data);
         return;
     }
 
@@ -242,17 +453,16 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
         gb->sc = data;
         break;
     case 0x04: // DIV (FF04)
-        gb->div = 0;
+        reset_div(gb);
         break;
     case 0x05: // TIMA (FF05)
-        gb->tima = data;
+        write_tima(gb, data);
         break;
     case 0x06: // TMA (FF06)
-        gb->tma = data;
+        write_tma(gb, data);
         break;
     case 0x07: // TAC (FF07)
-        gb->tac_en = data & (1 << 2);
-        gb->tac_clk = data & 0x3;
+        write_tac(gb, data);
         break;
     case 0x0F: // IF (FF0F)
         gb->if_ = data & 0x1F;
@@ -264,7 +474,7 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
         break;
     case 0x11: // AUD1LEN/NR11 (FF11)
         gb->ch1_duty = GET_BITS(data, 6, 7);
-        gb->ch1_len = (data & 0x3F) ^ 0x3F;
+        gb->ch1_len_ctr = 64 - (data & 0x3F);
         break;
     case 0x12: // AUD1ENV/NR12 (FF12)
         gb->ch1_env_init = GET_BITS(data, 4, 7);
@@ -289,7 +499,7 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
         break;
     case 0x16: // AUD2LEN/NR21 (FF16)
         gb->ch2_duty = GET_BITS(data, 6, 7);
-        gb->ch2_len = (data & 0x3F) ^ 0x3F;
+        gb->ch2_len_ctr = 64 - (data & 0x3F);
         break;
     case 0x17: // AUD2ENV/NR22 (FF17)
         gb->ch2_env_init = GET_BITS(data, 4, 7);
@@ -321,7 +531,7 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
         }
         break;
     case 0x1B: // AUD3LEN/NR31 (FF1B)
-        gb->ch3_len = ~data;
+        gb->ch3_len_ctr = 256 - data;
         break;
     case 0x1C: // AUD3LEVEL/NR32 (FF1C)
         gb->ch3_vol = GET_BITS(data, 5, 6);
@@ -338,7 +548,7 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
         }
         break;
     case 0x20: // AUD4LEN/NR41 (FF20)
-        gb->ch4_len = (data & 0x3F) ^ 0x3F;
+        gb->ch4_len_ctr = 64 - (data & 0x3F);
         break;
     case 0x21: // AUD4ENV/NR42 (FF21)
         gb->ch4_env_init = GET_BITS(data, 4, 7);
@@ -378,10 +588,14 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
         gb->ch1_r = GET_BIT(data, 0);
         break;
     case 0x26: // AUDENA/NR52 (FF26)
+        if (!gb->apu_en && GET_BIT(data, 7)) {
+            // The frame sequencer restarts when the APU is powered on
+            gb->div_apu_counter = 0;
+        }
         gb->apu_en = GET_BIT(data, 7);
         break;
     case 0x40: // LCDC (FF40)
-        gb->lcd_en = data & (1 << 7);
+        set_lcd_enabled(gb, data & (1 << 7));
         gb->win_map = data & (1 << 6);
         gb->win_en = data & (1 << 5);
         gb->tile_sel = data & (1 << 4);
@@ -391,7 +605,8 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
         gb->bg_en = data & (1 << 0);
         break;
     case 0x41: // STAT (FF41)
-        gb->stat = data;
+        gb->stat = data & 0x78;
+        update_stat_irq(gb);
         break;
     case 0x42: // SCY (FF42)
         gb->scy = data;
@@ -403,10 +618,14 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
         break;
     case 0x45: // LYC (FF45)
         gb->lyc = data;
+        update_stat_irq(gb);
         break;
     case 0x46: // DMA (FF46)
         for (u8 i = 0; i < 0xA0; i++) {
             gb->oam[i] = read(gb, (data << 8) + i);
+            if (gb->video_log) {
+                log_video_write(gb, 0xFE00 + i, gb->oam[i]);
+            }
         }
         break;
     case 0x47: // BGP (FF47)
@@ -414,18 +633,21 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
         gb->bgp[1] = (data >> 2) & 0x3;
         gb->bgp[2] = (data >> 4) & 0x3;
         gb->bgp[3] = (data >> 6) & 0x3;
+        update_pal_lut(gb);
         break;
     case 0x48: // OBP0 (FF48)
         gb->obp0[0] = (data >> 0) & 0x3;
         gb->obp0[1] = (data >> 2) & 0x3;
         gb->obp0[2] = (data >> 4) & 0x3;
         gb->obp0[3] = (data >> 6) & 0x3;
+        update_pal_lut(gb);
         break;
     case 0x49: // OBP1 (FF49)
         gb->obp1[0] = (data >> 0) & 0x3;
         gb->obp1[1] = (data >> 2) & 0x3;
         gb->obp1[2] = (data >> 4) & 0x3;
         gb->obp1[3] = (data >> 6) & 0x3;
+        update_pal_lut(gb);
         break;
     case 0x4A: // WY (FF4A)
         gb->wy = data;
@@ -446,33 +668,43 @@ void io_write(GameBoy* gb, u16 addr, u8 data) {
 u8 read(GameBoy* gb, u16 addr) {
     if (addr < 0x8000) {
         // 0x0000 - 0x7FFF (ROM)
+        COUNT_STAT(gb, reads[REGION_ROM]);
         u8* ptr = (addr & 0x4000) ? gb->rom_hi : gb->rom_lo;
         return ptr ? ptr[addr & 0x3FFF] : 0xFF;
     } else if (addr < 0xA000) {
         // 0x8000 - 0x9FFF (VRAM)
+        COUNT_STAT(gb, reads[REGION_VRAM]);
         return gb->vram[addr % 0x2000];
     } else if (addr < 0xC000) {
         // 0xA000 - 0xBFFF (External RAM)
+        COUNT_STAT(gb, reads[REGION_CARTRAM]);
         // TODO: implement external RAM
         return 0xFF;
     } else if (addr < 0xFE00) {
         // 0xC000 - 0xFDFF (WRAM)
+        COUNT_STAT(gb, reads[REGION_WRAM]);
         // Designed to account for echo RAM
         u8* ptr = (addr & 0x1000) ? gb->wram_hi : gb->wram_lo;
         return ptr[addr & 0x0FFF];
     } else if (addr < 0xFEA0) {
         // 0xFE00 - 0xFE9F (OAM)
+        COUNT_STAT(gb, reads[REGION_OAM]);
         return gb->oam[addr & 0xFF];
     } else if (addr < 0xFF00) {
         // 0xFEA0 - 0xFEFF (unused)
+        COUNT_STAT(gb, reads[REGION_UNUSED]);
         return 0xFF;
     } else if (addr < 0xFF80) {
         // 0xFF00 - 0xFF7F (IO)
+        COUNT_STAT(gb, reads[REGION_IO]);
         return io_read(gb, addr);
     } else if (addr < 0xFFFF) {
         // 0xFF80 - 0xFFFE (HRAM)
+        COUNT_STAT(gb, reads[REGION_HRAM]);
         return gb->hram[addr & 0x7F];
     } else {
+        // 0xFFFF (IE)
+        COUNT_STAT(gb, reads[REGION_IE]);
         return gb->ie;
     }
 }
@@ -480,56 +712,62 @@ u8 read(GameBoy* gb, u16 addr) {
 void write(GameBoy* gb, u16 addr, u8 data) {
     if (addr < 0x8000) {
         // 0x0000 - 0x7FFF (ROM)
+        COUNT_STAT(gb, writes[REGION_ROM]);
     } else if (addr < 0xA000) {
         // 0x8000 - 0x9FFF (VRAM)
+        COUNT_STAT(gb, writes[REGION_VRAM]);
         gb->vram[addr % 0x2000] = data;
+        if (gb->video_log) {
+            log_video_write(gb, addr, data);
+        }
     } else if (addr < 0xC000) {
         // 0xA000 - 0xBFFF (External RAM)
+        COUNT_STAT(gb, writes[REGION_CARTRAM]);
         // TODO: implement external RAM
     } else if (addr < 0xFE00) {
         // 0xC000 - 0xFDFF (WRAM)
+        COUNT_STAT(gb, writes[REGION_WRAM]);
         // Designed to account for echo RAM
         u8* ptr = (addr & 0x1000) ? gb->wram_hi : gb->wram_lo;
         ptr[addr & 0x0FFF] = data;
     } else if (addr < 0xFEA0) {
         // 0xFE00 - 0xFE9F (OAM)
+        COUNT_STAT(gb, writes[REGION_OAM]);
         gb->oam[addr & 0xFF] = data;
+        if (gb->video_log) {
+            log_video_write(gb, addr, data);
+        }
     } else if (addr < 0xFF00) {
         // 0xFEA0 - 0xFEFF (unused)
+        COUNT_STAT(gb, writes[REGION_UNUSED]);
     } else if (addr < 0xFF80) {
         // 0xFF00 - 0xFF7F (IO)
+        COUNT_STAT(gb, writes[REGION_IO]);
         io_write(gb, addr, data);
     } else if (addr < 0xFFFF) {
         // 0xFF80 - 0xFFFE (HRAM)
+        COUNT_STAT(gb, writes[REGION_HRAM]);
         gb->hram[addr & 0x7F] = data;
     } else {
         // 0xFFFF (IE)
+        COUNT_STAT(gb, writes[REGION_IE]);
         gb->ie = data & 0x1F;
     }
 }
 
 void cycle(GameBoy* gb) {
+#if RONDO_PROFILE
+    gb->prof->cycles++;
+#endif
+
+    COUNT_STAT(gb, cycles);
     if (gb->lcd_en) {
-        for (int i = 0; i < 4; i++) {
-            lcd_cycle(gb);
-        }
-    }
-    if (gb->apu_en) {
-        render_audio_sample(gb);
+        lcd_cycle(gb);
     }
 
-    // Divider register stuff
-    static const u16 TICK_MASKS[4] = {0x03FF, 0x000F, 0x003F, 0x00FF};
-    gb->div += 4;
-    if (!(gb->div & TICK_MASKS[gb->tac_clk]) && gb->tac_en) {
-        // Timer tick
-        gb->tima++;
-        if (!gb->tima) {
-            gb->tima = gb->tma;
-            gb->if_ |= (1 << 2);
-        }
-    }
-    if ((gb->div & 0x1FFF) && gb->apu_en) {
-        div_apu_event(gb);
+    // Timer overflows and frame sequencer steps
+    gb->clock += 4;
+    if (gb->clock >= gb->next_event) {
+        run_timer_events(gb);
     }
 }
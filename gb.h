@@ -6,18 +6,42 @@
 
 #define RONDO_BIG_ENDIAN 0
 
+// Build with RONDO_PROFILE=1 to compile in the instruction-level profiler
+#ifndef RONDO_PROFILE
+#define RONDO_PROFILE 0
+#endif
+
+// Build with RONDO_STATS=1 to count instructions, cycles and bus accesses and
+// to time frames, line drawing and the APU, see get_stats()
+#ifndef RONDO_STATS
+#define RONDO_STATS 0
+#endif
+
+// Build with RONDO_RENDER_THREAD=1 to have the libretro core draw lines on a
+// second thread, see render_thread.h
+#ifndef RONDO_RENDER_THREAD
+#define RONDO_RENDER_THREAD 0
+#endif
+
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
+typedef uint64_t u64;
 typedef int8_t s8;
 typedef int16_t s16;
+typedef int32_t s32;
 
 #define SCREEN_WIDTH 160
 #define SCREEN_HEIGHT 144
 
 #define FRAME_RATE 59.7275005696058
 
+// Blocks of GameBoy that are used together start on their own line
+#define GB_CACHE_LINE 64
+
 #define OAM_COUNT 40
+// Objects drawn per line, the rest are dropped by the OAM scan
+#define MAX_LINE_OBJS 10
 
 // Macro to define CPU register pairs
 #if RONDO_BIG_ENDIAN
@@ -40,11 +64,118 @@ typedef int16_t s16;
 
 typedef enum { DMG, SGB, CGB } GBType;
 
+// Regions of the memory map, used to bucket bus accesses
+typedef enum {
+    REGION_ROM,     // 0x0000-0x7FFF
+    REGION_VRAM,    // 0x8000-0x9FFF
+    REGION_CARTRAM, // 0xA000-0xBFFF
+    REGION_WRAM,    // 0xC000-0xFDFF
+    REGION_OAM,     // 0xFE00-0xFE9F
+    REGION_UNUSED,  // 0xFEA0-0xFEFF
+    REGION_IO,      // 0xFF00-0xFF7F
+    REGION_HRAM,    // 0xFF80-0xFFFE
+    REGION_IE,      // 0xFFFF
+    REGION_COUNT
+} MemRegion;
+
+// Host-side counters, cleared by reset_stats(). Only kept with RONDO_STATS.
+typedef struct GBStats {
+    u64 instructions;
+    u64 cycles; // Calls to cycle(), one per M-cycle
+    u64 reads[REGION_COUNT];
+    u64 writes[REGION_COUNT];
+    u64 io_reads[0x80];  // Indexed by address & 0x7F
+    u64 io_writes[0x80]; // Indexed by address & 0x7F
+    u64 frames;
+    u64 audio_samples;
+
+    // Host time in nanoseconds
+    u64 frame_ns; // Total time spent in run_frame()
+    u64 lcd_ns;   // Drawing lines, or whole frames when deferred
+    u64 apu_ns;   // Timed around each sync_apu() burst
+} GBStats;
+
+// Pixel layouts gb->fbuf can be drawn in, see fbuf.h
+typedef enum {
+    FBUF_XRGB8888, // One u32 per pixel
+    FBUF_RGB565,   // One u16 per pixel
+    FBUF_INDEXED8, // One shade (0-3) per byte
+    FBUF_PACKED2,  // Four shades per byte, leftmost pixel in bits 0-1
+} FBufFormat;
+
+// Palettes in GameBoy.pal_lut. PAL_OFF is the blank line shown while the
+// background is disabled.
+typedef enum { PAL_BG, PAL_OBP0, PAL_OBP1, PAL_OFF } PaletteId;
+
+// A line pixel before output: PaletteId * 4 + color index, see pal_lut
+#define PAL_CODE(pal, color) ((pal) * 4 + (color))
+
+// How mode 3 is emulated, see lcd.h
+typedef enum {
+    PPU_SCANLINE, // Draw each line at once, with a precomputed mode 3 length
+    PPU_FIFO,     // Step the pixel fetcher and FIFOs dot by dot
+} PPUBackend;
+
+// Mode 3 state of the pixel FIFO backend, see ldc.c
+typedef struct PixelFifo {
+    bool active; // The current line is being drawn by this backend
+    // BG/window FIFO, filled 8 pixels at a time once empty
+    u8 bg[8];
+    u8 bg_len;
+    // Object FIFO, slot (obj_head + i) % 8 is the pixel i dots from now
+    u8 obj[8];
+    u8 obj_attrs[8];
+    u8 obj_head;
+
+    // BG fetcher: 2 dots each for the tile ID, low and high bytes, then it
+    // waits until it can push. Negative during the discarded first fetch.
+    s8 fetch_step;
+    u8 fetch_x; // Tile column, relative to SCX or to the window's left edge
+    u16 tile_id;
+    u8 tile_lo, tile_hi;
+    bool in_win;
+
+    u8 discard; // Pixels still to drop from the left edge
+    u8 x;       // Next pixel to output
+
+    // Objects found by the OAM scan, as OAM indices
+    u8 objs[MAX_LINE_OBJS];
+    u8 obj_count;
+    bool obj_fetched[MAX_LINE_OBJS];
+    s8 obj_fetch; // Index into objs of the object being fetched, or -1
+    u8 obj_step;
+
+    u8 line[SCREEN_WIDTH]; // Output shades
+} PixelFifo;
+
+// State of an in-progress frame hash, see hash.h
+typedef struct HashState {
+    u64 acc[4];
+    u64 len;
+} HashState;
+
 typedef struct GameBoy {
-    GBType type;
-    void* fbuf;
+    // Hot: the CPU, the bus and the event scheduler, touched on every
+    // instruction. Kept within the first two cache lines, see gb.c.
+
+    // Internal CPU registers and flags
+    u8 a;
+    bool f_z, f_n, f_h, f_c;
+    u16 pc, sp;
+    REG_DEF(b, c)
+    REG_DEF(d, e)
+    REG_DEF(h, l)
+
+    bool ime;
+    u8 if_; // FF0F
+    u8 ie;  // FFFF
+
     bool end_frame;
 
+    // Timer overflows and frame sequencer steps, see timer.h
+    u64 clock;      // T-cycles since power on
+    u64 next_event; // Earliest scheduled event, as a value of clock
+
     // Pointers to various regions of the GB's memory map
     // 0x0000-0x3FFF
     u8* rom_lo;
@@ -63,15 +194,73 @@ typedef struct GameBoy {
     // 0xFF80-0xFFFF
     u8* hram;
 
-    // Internal CPU registers and flags
-    u8 a;
-    bool f_z, f_n, f_h, f_c;
-    u16 pc, sp;
-    REG_DEF(b, c)
-    REG_DEF(d, e)
-    REG_DEF(h, l)
+#if RONDO_STATS
+    // The counters bumped per instruction, M-cycle and access lead GBStats
+    _Alignas(GB_CACHE_LINE) GBStats stats;
+#endif
 
-    bool ime;
+    // Warm: the LCD, touched every M-cycle while it is on and per line
+    // LCDC (FF40)
+    _Alignas(GB_CACHE_LINE) bool lcd_en; // Bit 7
+    bool win_map;  // Bit 6
+    bool win_en;   // Bit 5
+    bool tile_sel; // Bit 4
+    bool bg_map;   // Bit 3
+    bool obj_size; // Bit 2
+    bool obj_en;   // Bit 1
+    bool bg_en;    // Bit 0
+
+    // Ranges from -80 to 375 on each scanline
+    s16 dots;
+    // Value of dots at which the current mode ends
+    s16 mode_end;
+
+    // STAT (FF41), only the interrupt enable bits (3-6)
+    u8 stat;
+    u8 stat_mode;       // Bits 0-1
+    bool stat_irq_line; // Whether any enabled STAT source is active
+
+    u8 scy;     // FF42
+    u8 scx;     // FF43
+    u8 ly;      // FF44
+    u8 lyc;     // FF45
+    u8 bgp[4];  // FF47
+    u8 obp0[4]; // FF48
+    u8 obp1[4]; // FF49
+    // Every palette color as an fbuf_format pixel, indexed by PAL_CODE().
+    // Rebuilt on palette writes and format changes, see update_pal_lut().
+    u32 pal_lut[16];
+    u8 wy;      // FF4A
+    u8 wx;      // FF4B
+    // Lines of the window drawn so far this frame
+    u8 win_line;
+    // LY has matched WY this frame, checked as each line's OAM scan ends. The
+    // window only shows from then on, even if WY changes later.
+    bool wy_hit;
+
+    void* fbuf;
+    FBufFormat fbuf_format;
+    bool skip_video; // Don't draw pixels into fbuf, timing is unaffected
+    bool hash_video; // Hash every drawn frame, not with the render thread
+    u64 frame_hash;  // Hash of the last frame drawn with hash_video set
+    HashState line_hash;
+    // Non-null while drawing is deferred to V-Blank, see video_log.h
+    struct VideoLog* video_log;
+    struct DeferredVideo* deferred_video;
+    // Non-null while deferred frames are drawn on a second thread, see
+    // render_thread.h
+    struct RenderThread* render_thread;
+
+    PPUBackend ppu_backend;
+    PixelFifo fifo;
+
+    // Cold: configuration, IO registers and the APU, which runs in bursts
+    _Alignas(GB_CACHE_LINE) GBType type;
+    bool no_audio; // Don't make samples, games still see the same APU
+    // Resampled audio waiting for the frontend, see audio_out.h
+    struct AudioOut* audio_out;
+    // Where destroy_gb() returns this instance's memory, see fork_gb()
+    struct GBPool* pool;
 
     // FF00 (joypad/P1)
     u8 input; // d-pad in the low nibble, buttons in the high
@@ -81,18 +270,22 @@ typedef struct GameBoy {
     u8 sb; // FF01
     u8 sc; // FF02
 
-    // Timer registers
-    u16 div; // Upper 8 bits are FF04
-    u8 tima; // FF05
-    u8 tma;  // FF06
+    // Timer registers, see timer.h
+    u64 div_epoch; // clock at the last DIV reset
+    u8 tima;       // FF05, up to date as of tima_sync
+    u64 tima_sync;
+    u8 tma; // FF06
     // TAC (FF07)
     bool tac_en; // Bit 2
     u8 tac_clk;  // Bits 0-1
-
-    u8 if_; // FF0F
+    // Scheduled events, as values of clock
+    u64 tima_overflow;
+    u64 seq_next; // Frame sequencer step (DIV bit 12 falling edge)
 
     // Audio stuff
     u8 div_apu_counter;
+    u64 apu_clock; // clock the APU has been run up to, see sync_apu()
+    float hpf_cap[2]; // Output high-pass filter state, left and right
 
     // Channel 1
     u16 ch1_timer;
@@ -103,14 +296,18 @@ typedef struct GameBoy {
     u8 ch1_sweep_time;  // Bits 4-6
     bool ch1_sweep_dir; // Bit 3
     u8 ch1_sweep_shift; // Bits 0-2
+    bool ch1_sweep_en;
+    u8 ch1_sweep_timer;
+    u16 ch1_sweep_freq; // Shadow of the (non-inverted) period
     // AUD1LEN/NR11 (FF11)
-    u8 ch1_duty; // Bits 6-7
-    u8 ch1_len;  // Bits 0-5 (inverted)
-    u8 ch1_len_ctr;
+    u8 ch1_duty;    // Bits 6-7
+    u8 ch1_len_ctr; // Steps left, 64 minus bits 0-5
     // AUD1ENV/NR12 (FF12)
     u8 ch1_env_init;  // Bits 4-7
     bool ch1_env_dir; // Bit 3
     u8 ch1_env_sweep; // Bits 0-2
+    u8 ch1_env_vol;   // Current volume, starts at ch1_env_init
+    u8 ch1_env_timer;
     // AUD1LOW/NR13 (FF13)
     // AUD1HIGH/NR14 (FF14)
     u16 ch1_period;  // NR13 bits 0-7, NR14 bits 0-2 (inverted)
@@ -122,13 +319,14 @@ typedef struct GameBoy {
     bool ch2_dac;
     bool ch2_active;
     // AUD2LEN/NR21 (FF16)
-    u8 ch2_duty; // Bits 6-7
-    u8 ch2_len;  // Bits 0-5 (inverted)
-    u8 ch2_len_ctr;
+    u8 ch2_duty;    // Bits 6-7
+    u8 ch2_len_ctr; // Steps left, 64 minus bits 0-5
     // AUD2ENV/NR22 (FF17)
     u8 ch2_env_init;  // Bits 4-7
     bool ch2_env_dir; // Bit 3
     u8 ch2_env_sweep; // Bits 0-2
+    u8 ch2_env_vol;   // Current volume, starts at ch2_env_init
+    u8 ch2_env_timer;
     // AUD2LOW/NR23 (FF18)
     // AUD2HIGH/NR24 (FF19)
     u16 ch2_period;  // NR23 bits 0-7, NR24 bits 0-2 (inverted)
@@ -140,8 +338,7 @@ typedef struct GameBoy {
     bool ch3_dac; // AUD3ENA/NR30 (FF1A), Bit 7
     bool ch3_active;
     // AUD3LEN/NR31 (FF1B)
-    u8 ch3_len; // Bits 0-7 (inverted)
-    u8 ch3_len_ctr;
+    u16 ch3_len_ctr; // Steps left, 256 minus bits 0-7
     // AUD3LEVEL/NR32 (FF1C)
     u8 ch3_vol; // Bits 5-6
     // AUD3LOW/NR33 (FF1D)
@@ -150,18 +347,19 @@ typedef struct GameBoy {
     bool ch3_len_en; // NR34 bit 6
 
     // Channel 4
-    u32 ch4_timer;
-    u32 ch4_period;
+    u32 ch4_timer;  // M-cycles to the next LFSR clock, minus 1
+    u32 ch4_period; // 0 while the LFSR is stopped
     u16 ch4_lfsr;
     bool ch4_dac;
     bool ch4_active;
     // AUD4LEN/NR41 (FF20)
-    u8 ch4_len; // Bits 0-5 (inverted)
-    u8 ch4_len_ctr;
+    u8 ch4_len_ctr; // Steps left, 64 minus bits 0-5
     // AUD4ENV/NR42 (FF21)
     u8 ch4_env_init;  // Bits 4-7
     bool ch4_env_dir; // Bit 3
     u8 ch4_env_sweep; // Bits 0-2
+    u8 ch4_env_vol;   // Current volume, starts at ch4_env_init
+    u8 ch4_env_timer;
     // AUD4POLY/NR43 (FF22)
     u8 ch4_shift;   // Bits 4-7
     bool ch4_width; // Bit 3
@@ -186,50 +384,50 @@ typedef struct GameBoy {
     // AUDENA/NR52 (FF26)
     bool apu_en; // Bit 7
 
-    // FF30-FF3F
-    u8 wave_ram[32];
-
-    // LCDC (FF40)
-    bool lcd_en;   // Bit 7
-    bool win_map;  // Bit 6
-    bool win_en;   // Bit 5
-    bool tile_sel; // Bit 4
-    bool bg_map;   // Bit 3
-    bool obj_size; // Bit 2
-    bool obj_en;   // Bit 1
-    bool bg_en;    // Bit 0
-
-    // STAT (FF41)
-    u8 stat;
-
-    u8 scy;     // FF42
-    u8 scx;     // FF43
-    u8 ly;      // FF44
-    u8 lyc;     // FF45
-    u8 bgp[4];  // FF47
-    u8 obp0[4]; // FF48
-    u8 obp1[4]; // FF49
-    u8 wy;      // FF4A
-    u8 wx;      // FF4B
-
-    u8 ie; // FFFF
+    // FF30-FF3F, two 4-bit samples per byte, the first in the high nibble
+    u8 wave_ram[16];
+    // DAC output of each wave sample at each NR32 volume, see apu.c
+    s8 ch3_dac_table[4][32];
 
-    // Ranges from -80 to 375 on each scanline
-    s16 dots;
+#if RONDO_PROFILE
+    struct Profile* prof;
+#endif
 } GameBoy;
 
 // Return null if there was a problem
 GameBoy* make_gb(u8* rom, size_t size);
 void destroy_gb(GameBoy* gb);
 
+// Keeps the memory of destroyed instances for reuse, so that forking doesn't
+// wait on fresh pages from the OS. Not thread safe, use one pool per thread.
+typedef struct GBPool GBPool;
+// Keep up to max_free unused instances
+GBPool* make_gb_pool(size_t max_free);
+// Instances forked into the pool must be destroyed first
+void destroy_gb_pool(GBPool* pool);
+
+// Return a new instance in the same state as gb, for branching into several
+// futures. The ROM is shared, so it must outlive both. Only the emulated
+// state (about 20 KB) is copied: the child's framebuffer starts blank, its
+// audio ring empty, and it draws lines directly. Must not be called while gb
+// is running on another thread. pool may be null.
+GameBoy* fork_gb(GameBoy* gb, GBPool* pool);
+
 void run_frame(GameBoy* gb);
 
+#if RONDO_STATS
+const GBStats* get_stats(GameBoy* gb);
+void reset_stats(GameBoy* gb);
+// Monotonic time in nanoseconds, only meaningful as a difference
+u64 get_time_ns(void);
+#define COUNT_STAT(gb, counter) ((gb)->stats.counter++)
+#else
+#define COUNT_STAT(gb, counter) ((void)0)
+#endif
+
 u8 read(GameBoy* gb, u16 addr);
 void write(GameBoy* gb, u16 addr, u8 data);
 
 void cycle(GameBoy* gb);
 
-// Defined in libretro.c
-void play_sample(s16 l, s16 r);
-
 #endif
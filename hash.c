@@ -0,0 +1,81 @@
+#include "hash.h"
+
+#include "fbuf.h"
+#include "string.h"
+
+#define PRIME1 0x9E3779B185EBCA87
+#define PRIME2 0xC2B2AE3D27D4EB4F
+#define PRIME3 0x165667B19E3779F9
+#define PRIME4 0x85EBCA77C2B2AE63
+#define PRIME5 0x27D4EB2F165667C5
+
+static inline u64 rotl(u64 x, int r) { return x << r | x >> (64 - r); }
+
+static inline u64 hash_round(u64 acc, u64 lane) {
+    acc += lane * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline u64 hash_merge(u64 hash, u64 acc) {
+    hash ^= hash_round(0, acc);
+    return hash * PRIME1 + PRIME4;
+}
+
+void hash_begin(HashState* state) {
+    state->acc[0] = PRIME1 + PRIME2;
+    state->acc[1] = PRIME2;
+    state->acc[2] = 0;
+    state->acc[3] = 0 - PRIME1;
+    state->len = 0;
+}
+
+void hash_update(HashState* state, const void* data, size_t len) {
+    const u8* bytes = data;
+    u64 a0 = state->acc[0], a1 = state->acc[1];
+    u64 a2 = state->acc[2], a3 = state->acc[3];
+    for (size_t i = 0; i + HASH_STRIPE <= len; i += HASH_STRIPE) {
+        u64 lanes[4];
+        memcpy(lanes, bytes + i, sizeof(lanes));
+        a0 = hash_round(a0, lanes[0]);
+        a1 = hash_round(a1, lanes[1]);
+        a2 = hash_round(a2, lanes[2]);
+        a3 = hash_round(a3, lanes[3]);
+    }
+    state->acc[0] = a0;
+    state->acc[1] = a1;
+    state->acc[2] = a2;
+    state->acc[3] = a3;
+    state->len += len;
+}
+
+u64 hash_end(const HashState* state) {
+    const u64* acc = state->acc;
+    u64 hash;
+    if (state->len >= HASH_STRIPE) {
+        hash = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) +
+               rotl(acc[3], 18);
+        hash = hash_merge(hash, acc[0]);
+        hash = hash_merge(hash, acc[1]);
+        hash = hash_merge(hash, acc[2]);
+        hash = hash_merge(hash, acc[3]);
+    } else {
+        // Only reachable for an empty stream
+        hash = PRIME5;
+    }
+    hash += state->len;
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+u64 hash_fbuf(GameBoy* gb) {
+    HashState state;
+    hash_begin(&state);
+    hash_update(&state, gb->fbuf, fbuf_size(gb->fbuf_format));
+    return hash_end(&state);
+}
@@ -0,0 +1,19 @@
+#ifndef RONDO_HASH_H
+#define RONDO_HASH_H
+
+#include "gb.h"
+
+// Streaming 64-bit hash following the XXH64 algorithm (seed 0). Data must be
+// fed in multiples of HASH_STRIPE bytes, which every framebuffer row is.
+// Lanes are read in host byte order, so hashes match XXH64 on little-endian
+// hosts only. HashState itself lives in gb.h.
+#define HASH_STRIPE 32
+
+void hash_begin(HashState* state);
+void hash_update(HashState* state, const void* data, size_t len);
+u64 hash_end(const HashState* state);
+
+// Hash the whole framebuffer in one go, same result as hashing it row by row
+u64 hash_fbuf(GameBoy* gb);
+
+#endif
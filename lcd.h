@@ -1,6 +1,42 @@
 #ifndef RONDO_LCD_H
 #define RONDO_LCD_H
 
+#include "gb.h"
+
+// Everything besides VRAM and OAM that decides how a line is drawn
+typedef struct LineState {
+    u8 ly;
+    bool win_map, win_en, tile_sel, bg_map, obj_size, obj_en, bg_en;
+    u8 scy, scx, wy, wx;
+    u8 win_line; // The window's internal line counter
+    bool wy_hit; // See GameBoy.wy_hit
+    u32 pal_lut[16];
+} LineState;
+
+// LCD modes, as reported in STAT bits 0-1
+enum { MODE_HBLANK, MODE_VBLANK, MODE_OAM_SCAN, MODE_DRAW };
+
+// Advance the LCD by one M-cycle (4 dots)
 void lcd_cycle(struct GameBoy* gb);
+// Select how mode 3 is emulated from the next line on. PPU_FIFO is slower,
+// but gets mid-line register and VRAM writes right. It draws lines as they
+// happen, so it stops deferred and threaded drawing.
+void set_ppu_backend(GameBoy* gb, PPUBackend backend);
+// LCDC bit 7. Turning the LCD off resets LY, the mode and the STAT line to 0,
+// turning it back on restarts the frame at line 0.
+void set_lcd_enabled(GameBoy* gb, bool enabled);
+// Re-evaluate the STAT interrupt line after STAT, LY or LYC changed
+void update_stat_irq(GameBoy* gb);
+
+// Dots since line 0 started drawing (at dot 0 of the line), negative during
+// the V-Blank that precedes it
+s32 lcd_frame_time(GameBoy* gb);
+
+// Snapshot the registers for drawing the current line
+void capture_line(GameBoy* gb, LineState* state);
+// Draw line state->ly into fbuf, which is in the given format. Return whether
+// the window was visible, which advances its line counter.
+bool draw_line(const LineState* state, const u8* vram, const u8* oam,
+               void* fbuf, FBufFormat format);
 
 #endif
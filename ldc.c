@@ -1,78 +1,632 @@
 #include "lcd.h"
 
+#include "fbuf.h"
 #include "gb.h"
+#include "hash.h"
+#include "render_thread.h"
 #include "stdio.h"
+#include "string.h"
+#include "tile.h"
+#include "video_log.h"
 
-u32 colors[4] = {0xFFFFFF, 0xAAAAAA, 0x555555, 0x000000};
+// Line timing in dots, relative to the start of mode 3. Mode 2 (OAM scan)
+// starts 80 dots earlier, and mode 3 lasts at least MODE3_MIN dots.
+#define MODE3_MIN 172
+#define LINE_END 376
 
 // tile_ids from 0x100 to 0x17F are used for BG/Window tiles in $9000–$97FF
-// x and y should be in the range [0,7]
-static u8 get_tile_pixel(GameBoy* gb, u16 tile_id, u8 x, u8 y) {
-    u8 lsb = gb->vram[16 * tile_id + 2 * y];
-    u8 msb = gb->vram[16 * tile_id + 2 * y + 1];
-    lsb = (lsb >> (7 - x)) & 1;
-    msb = (msb >> (7 - x)) & 1;
-    return (msb << 1) + lsb;
+// y is the row within the tile, [0,7] (or [0,15] for 8x16 objects)
+static void get_tile_row(const u8* vram, u16 tile_id, u8 y, u8* lo, u8* hi) {
+    *lo = vram[16 * tile_id + 2 * y];
+    *hi = vram[16 * tile_id + 2 * y + 1];
 }
 
 // x and y are tile-based coords, not pixel-based
-static u8 get_bg_tile(GameBoy* gb, u8 x, u8 y, bool is_win) {
-    bool is_alt_map = is_win ? gb->win_map : gb->bg_map;
-    u8* tile_map = is_alt_map ? (gb->vram + 0x1C00) : (gb->vram + 0x1800);
+static u8 get_bg_tile(const LineState* state, const u8* vram, u8 x, u8 y,
+                      bool is_win) {
+    bool is_alt_map = is_win ? state->win_map : state->bg_map;
+    const u8* tile_map = is_alt_map ? (vram + 0x1C00) : (vram + 0x1800);
     return tile_map[y * 32 + x];
 }
 
-// Get background/window pixel
-static u8 get_bg_pixel(GameBoy* gb, u8 x, u8 y) {
-    u16 tile_id = get_bg_tile(gb, x / 8, y / 8, false);
-    if (!gb->tile_sel && (tile_id < 0x80)) {
-        tile_id += 0x100;
+// Decode row y (pixel-based) of `count` tiles of a tile map, starting at tile
+// column x and wrapping around, into 8 color indices per tile. Each tile map
+// entry is fetched once for its whole 8 pixel span.
+static void decode_map_row(const LineState* state, const u8* vram,
+                           const TileKernels* kernels, bool is_win, u8 x, u8 y,
+                           size_t count, u8* indices) {
+    u8 lo[SCREEN_WIDTH / 8 + 1], hi[SCREEN_WIDTH / 8 + 1];
+    for (size_t i = 0; i < count; i++) {
+        u16 tile_id = get_bg_tile(state, vram, (x + i) % 32, y / 8, is_win);
+        if (!state->tile_sel && (tile_id < 0x80)) {
+            tile_id += 0x100;
+        }
+        get_tile_row(vram, tile_id, y % 8, &lo[i], &hi[i]);
     }
-    return get_tile_pixel(gb, tile_id, x % 8, y % 8);
+    kernels->decode_rows(lo, hi, count, indices);
+}
+
+static void render_bg_line(const LineState* state, const u8* vram,
+                           const TileKernels* kernels, u8* line) {
+    // Scrolling by a partial tile needs one extra tile on the right
+    u8 indices[SCREEN_WIDTH + 8];
+    u8 y = state->ly + state->scy;
+    decode_map_row(state, vram, kernels, false, state->scx / 8, y,
+                   SCREEN_WIDTH / 8 + 1, indices);
+    memcpy(line, indices + state->scx % 8, SCREEN_WIDTH);
+}
+
+// Whether the window covers part of the line, ignoring the BG enable bit
+static bool win_visible(const LineState* state) {
+    return state->win_en && state->wy_hit && state->wx <= 166;
 }
 
-static u8 get_obj_pixel(GameBoy* gb, u8 x, u8 y) {
-    // Objects
-    for (size_t i = 0; i < OAM_COUNT; i++) {
-        u8* obj = &gb->oam[i * 4];
-        u8 obj_x = x - obj[1] + 8;
-        u8 obj_y = y - obj[0] + 16;
+// Return whether the window covers part of the line
+static bool render_win_line(const LineState* state, const u8* vram,
+                            const TileKernels* kernels, u8* line) {
+    if (!win_visible(state)) {
+        return false;
+    }
+
+    // WX is the left edge plus 7, smaller values cut off the first pixels
+    int start = state->wx - 7;
+    int skip = 0;
+    if (start < 0) {
+        skip = -start;
+        start = 0;
+    }
+    size_t width = SCREEN_WIDTH - start;
+    u8 indices[SCREEN_WIDTH + 8];
+    decode_map_row(state, vram, kernels, true, 0, state->win_line,
+                   (skip + width + 7) / 8, indices);
+    memcpy(line + start, indices + skip, width);
+    return true;
+}
 
-        if (obj_x < 8 && obj_y < 8) {
-            return get_tile_pixel(gb, obj[2], obj_x, obj_y);
+// Mode 2: find the first 10 objects in OAM order that overlap the line
+static size_t scan_oam(const LineState* state, const u8* oam,
+                       const u8** objs) {
+    u8 height = state->obj_size ? 16 : 8;
+    size_t count = 0;
+    for (size_t i = 0; i < OAM_COUNT && count < MAX_LINE_OBJS; i++) {
+        const u8* obj = &oam[i * 4];
+        if ((u8)(state->ly - obj[0] + 16) < height) {
+            objs[count++] = obj;
         }
     }
-    return 0;
+    return count;
 }
 
-static void render_pixel(GameBoy* gb, u8 x, u8 y) {
-    u8 bg_pixel = get_bg_pixel(gb, x, y);
-    u8 obj_pixel = get_obj_pixel(gb, x, y);
+// Draw the objects over the background in line. Objects with the priority
+// bit set stay behind background colors 1-3.
+static void render_obj_line(const LineState* state, const u8* vram,
+                            const u8* oam, const TileKernels* kernels,
+                            u8* line) {
+    u8 y = state->ly;
+    u8 height = state->obj_size ? 16 : 8;
+    const u8* objs[MAX_LINE_OBJS];
+    size_t count = scan_oam(state, oam, objs);
+
+    // Smaller X wins, ties go to the earlier OAM entry (the sort is stable)
+    for (size_t i = 1; i < count; i++) {
+        const u8* obj = objs[i];
+        size_t j = i;
+        for (; j > 0 && objs[j - 1][1] > obj[1]; j--) {
+            objs[j] = objs[j - 1];
+        }
+        objs[j] = obj;
+    }
+
+    // Draw from lowest to highest priority, so that each column ends up with
+    // the highest priority opaque pixel. Columns are offset by 8 (matching
+    // OAM X) so objects hanging off either edge need no clipping.
+    u8 obj_indices[256 + 8] = {0};
+    u8 obj_attrs[256 + 8];
+    for (size_t i = count; i-- > 0;) {
+        const u8* obj = objs[i];
+        u8 row = y - obj[0] + 16;
+        if (obj[3] & (1 << 6)) {
+            // Y flip
+            row = height - 1 - row;
+        }
+        u8 tile_id = height == 16 ? obj[2] & 0xFE : obj[2];
+        u8 lo, hi, pixels[8];
+        get_tile_row(vram, tile_id, row, &lo, &hi);
+        kernels->decode_rows(&lo, &hi, 1, pixels);
 
-    u8 pixel = obj_pixel ? obj_pixel : bg_pixel;
+        bool x_flip = obj[3] & (1 << 5);
+        for (u8 p = 0; p < 8; p++) {
+            u8 pixel = pixels[x_flip ? 7 - p : p];
+            if (pixel) {
+                obj_indices[obj[1] + p] = pixel;
+                obj_attrs[obj[1] + p] = obj[3];
+            }
+        }
+    }
 
-    // Set pixel in fbuf
-    u32* buff = gb->fbuf;
-    buff[x + SCREEN_WIDTH * y] = colors[pixel];
+    for (u8 x = 0; x < SCREEN_WIDTH; x++) {
+        u8 pixel = obj_indices[x + 8];
+        u8 attrs = obj_attrs[x + 8];
+        if (pixel && !((attrs & (1 << 7)) && (line[x] & 3))) {
+            PaletteId pal = (attrs & (1 << 4)) ? PAL_OBP1 : PAL_OBP0;
+            line[x] = PAL_CODE(pal, pixel);
+        }
+    }
 }
 
-void lcd_cycle(GameBoy* gb) {
-    gb->dots++;
-    if (gb->dots >= 376) {
-        gb->dots = -80;
-        gb->ly++;
-        if (gb->ly >= 154) {
-            gb->ly = 0;
+// Hash every complete stripe of fbuf up to the end of the current line. Rows
+// of packed framebuffers are shorter than a stripe, so they go in groups.
+static void hash_lines(GameBoy* gb) {
+    size_t end = (gb->ly + 1) * fbuf_pitch(gb->fbuf_format);
+    end -= end % HASH_STRIPE;
+    size_t start = gb->line_hash.len;
+    if (end > start) {
+        hash_update(&gb->line_hash, (u8*)gb->fbuf + start, end - start);
+    }
+}
+
+void capture_line(GameBoy* gb, LineState* state) {
+    state->ly = gb->ly;
+    state->win_map = gb->win_map;
+    state->win_en = gb->win_en;
+    state->tile_sel = gb->tile_sel;
+    state->bg_map = gb->bg_map;
+    state->obj_size = gb->obj_size;
+    state->obj_en = gb->obj_en;
+    state->bg_en = gb->bg_en;
+    state->scy = gb->scy;
+    state->scx = gb->scx;
+    state->wy = gb->wy;
+    state->wx = gb->wx;
+    state->win_line = gb->win_line;
+    state->wy_hit = gb->wy_hit;
+    memcpy(state->pal_lut, gb->pal_lut, sizeof(state->pal_lut));
+}
+
+bool draw_line(const LineState* state, const u8* vram, const u8* oam,
+               void* fbuf, FBufFormat format) {
+    const TileKernels* kernels = get_tile_kernels();
+    // BG color indices are already PAL_BG codes
+    u8 line[SCREEN_WIDTH];
+    bool win_drawn = false;
+
+    // On the DMG, the BG enable bit also hides the window
+    if (state->bg_en) {
+        render_bg_line(state, vram, kernels, line);
+        win_drawn = render_win_line(state, vram, kernels, line);
+    } else {
+        // With the background disabled, the DMG shows blank white instead
+        memset(line, PAL_CODE(PAL_OFF, 0), sizeof(line));
+    }
+    if (state->obj_en) {
+        render_obj_line(state, vram, oam, kernels, line);
+    }
+
+    write_fbuf_line(fbuf, format, state->pal_lut, state->ly, line);
+    return win_drawn;
+}
+
+static void render_line(GameBoy* gb, const LineState* state) {
+#if RONDO_STATS
+    u64 start = get_time_ns();
+#endif
+    if (draw_line(state, gb->vram, gb->oam, gb->fbuf, gb->fbuf_format)) {
+        gb->win_line++;
+    }
+    if (gb->hash_video) {
+        hash_lines(gb);
+    }
+#if RONDO_STATS
+    gb->stats.lcd_ns += get_time_ns() - start;
+#endif
+}
+
+// Length of mode 3 in dots. Fetching starts 172 dots' worth of work, plus:
+// - the fine scroll (SCX % 8) pixels that are fetched and dropped,
+// - 6 dots to restart the fetcher when the window starts,
+// - per object, 6 dots to fetch it plus waiting for the BG fetch of the tile
+//   its leftmost pixel is in (5 - offset dots, once per tile). Objects at
+//   OAM X 0 always cost 11 dots.
+static s16 mode3_length(const LineState* state, const u8* oam) {
+    s16 length = MODE3_MIN + state->scx % 8;
+    bool window = state->bg_en && win_visible(state);
+    if (window) {
+        length += 6;
+    }
+    if (!state->obj_en) {
+        return length;
+    }
+
+    const u8* objs[MAX_LINE_OBJS];
+    size_t count = scan_oam(state, oam, objs);
+    // Tiles are numbered in screen space, window tiles after BG tiles
+    bool tile_done[64] = {false};
+    int win_start = window ? state->wx - 7 : 256;
+    for (size_t i = 0; i < count; i++) {
+        int x = objs[i][1];
+        if (x == 0) {
+            length += 11;
+            continue;
         }
+        if (x >= SCREEN_WIDTH + 8) {
+            // Never reached by the fetcher
+            continue;
+        }
+
+        int pixel = x - 8;
+        size_t tile;
+        int offset;
+        if (pixel >= win_start) {
+            tile = 32 + (pixel - win_start) / 8;
+            offset = (pixel - win_start) % 8;
+        } else {
+            tile = (size_t)(pixel + 8 + state->scx % 8) / 8;
+            offset = (pixel + state->scx) & 7;
+        }
+        if (!tile_done[tile]) {
+            tile_done[tile] = true;
+            length += offset < 5 ? 5 - offset : 0;
+        }
+        length += 6;
+    }
+    return length;
+}
+
+s32 lcd_frame_time(GameBoy* gb) {
+    s32 line = gb->ly < SCREEN_HEIGHT ? gb->ly : gb->ly - 154;
+    return line * 456 + gb->dots;
+}
+
+void update_stat_irq(GameBoy* gb) {
+    bool line = false;
+    if ((gb->stat & (1 << 6)) && gb->ly == gb->lyc) {
+        line = true;
+    }
+    // Bits 3-5 enable the mode 0-2 sources
+    if (gb->stat_mode != MODE_DRAW && (gb->stat & (1 << (3 + gb->stat_mode)))) {
+        line = true;
+    }
+
+    // All sources share one line, so a new source going high while another
+    // one already is does not fire the interrupt again
+    if (line && !gb->stat_irq_line) {
+        gb->if_ |= (1 << 1);
+    }
+    gb->stat_irq_line = line;
+}
+
+static void set_mode(GameBoy* gb, u8 mode, s16 mode_end) {
+    gb->stat_mode = mode;
+    gb->mode_end = mode_end;
+    update_stat_irq(gb);
+}
+
+static void start_vblank(GameBoy* gb) {
+    // Set V-Blank flag in IF
+    gb->if_ |= (1 << 0);
+    gb->end_frame = true;
+    if (gb->render_thread) {
+        submit_render_frame(gb);
+    } else if (gb->deferred_video) {
+#if RONDO_STATS
+        u64 start = get_time_ns();
+        draw_deferred_frame(gb);
+        gb->stats.lcd_ns += get_time_ns() - start;
+#else
+        draw_deferred_frame(gb);
+#endif
+    } else if (gb->hash_video && !gb->skip_video) {
+        gb->frame_hash = hash_end(&gb->line_hash);
+    }
+}
+
+static void next_line(GameBoy* gb) {
+    gb->dots = -80;
+    gb->ly++;
+    if (gb->ly >= 154) {
+        gb->ly = 0;
+        gb->win_line = 0;
+        gb->wy_hit = false;
+        hash_begin(&gb->line_hash);
+    }
+
+    if (gb->ly < SCREEN_HEIGHT) {
+        set_mode(gb, MODE_OAM_SCAN, 0);
+    } else {
+        // Also rechecks LYC on the lines after the first
+        set_mode(gb, MODE_VBLANK, LINE_END);
         if (gb->ly == SCREEN_HEIGHT) {
-            // Set V-Blank flag in IF
-            gb->if_ |= (1 << 0);
-            gb->end_frame = true;
+            start_vblank(gb);
+        }
+    }
+}
+
+// Pixel FIFO backend. Instead of drawing the line at once, the BG fetcher,
+// object fetches and pixel output are stepped one dot at a time through mode
+// 3, reading registers, VRAM and OAM as they go. Writes made during mode 3
+// land on the pixels the hardware would give them, and mode 3 ends on the dot
+// the 160th pixel is pushed out.
+
+static void fifo_start_line(GameBoy* gb) {
+    PixelFifo* f = &gb->fifo;
+    LineState state;
+    capture_line(gb, &state);
+    const u8* objs[MAX_LINE_OBJS];
+    f->obj_count = scan_oam(&state, gb->oam, objs);
+    for (size_t i = 0; i < f->obj_count; i++) {
+        f->objs[i] = (objs[i] - gb->oam) / 4;
+        f->obj_fetched[i] = false;
+    }
+    f->obj_fetch = -1;
+
+    f->active = true;
+    f->bg_len = 0;
+    memset(f->obj, 0, sizeof(f->obj));
+    f->obj_head = 0;
+    // The first tile is fetched twice, the first time for nothing
+    f->fetch_step = -6;
+    f->fetch_x = 0;
+    f->in_win = false;
+    f->discard = gb->scx % 8;
+    f->x = 0;
+}
+
+static void fifo_fetch_bg(GameBoy* gb) {
+    PixelFifo* f = &gb->fifo;
+    if (f->fetch_step < 6) {
+        u8 y = f->in_win ? gb->win_line : gb->ly + gb->scy;
+        switch (++f->fetch_step) {
+        case 2: {
+            bool is_alt_map = f->in_win ? gb->win_map : gb->bg_map;
+            const u8* tile_map = gb->vram + (is_alt_map ? 0x1C00 : 0x1800);
+            u8 x = f->in_win ? f->fetch_x : gb->scx / 8 + f->fetch_x;
+            f->tile_id = tile_map[(y / 8) * 32 + x % 32];
+            if (!gb->tile_sel && (f->tile_id < 0x80)) {
+                f->tile_id += 0x100;
+            }
+            break;
+        }
+        case 4:
+            f->tile_lo = gb->vram[16 * f->tile_id + 2 * (y % 8)];
+            break;
+        case 6:
+            f->tile_hi = gb->vram[16 * f->tile_id + 2 * (y % 8) + 1];
+            break;
         }
+        return;
     }
+    // The fetched row is pushed on the first dot the FIFO is empty
+    if (!f->bg_len) {
+        get_tile_kernels()->decode_rows(&f->tile_lo, &f->tile_hi, 1, f->bg);
+        f->bg_len = 8;
+        f->fetch_step = 0;
+        f->fetch_x++;
+    }
+}
+
+// Return the index into fifo.objs of an object starting at the next pixel,
+// or -1
+static s8 fifo_next_obj(GameBoy* gb) {
+    PixelFifo* f = &gb->fifo;
+    if (!gb->obj_en) {
+        return -1;
+    }
+    for (size_t i = 0; i < f->obj_count; i++) {
+        u8 x = gb->oam[4 * f->objs[i] + 1];
+        // Objects hanging off the left edge start at pixel 0, and only those
+        // at X 0 are matched while the fine scroll pixels are dropped
+        bool match = f->discard ? x == 0 : x <= f->x + 8;
+        if (!f->obj_fetched[i] && match) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Object fetches take 6 dots, after which the row is mixed into the object
+// FIFO. Pixels already there came from a higher priority object, so only
+// transparent slots are filled.
+static void fifo_fetch_obj(GameBoy* gb) {
+    PixelFifo* f = &gb->fifo;
+    if (++f->obj_step < 6) {
+        return;
+    }
+
+    const u8* obj = &gb->oam[4 * f->objs[f->obj_fetch]];
+    u8 height = gb->obj_size ? 16 : 8;
+    u8 row = (gb->ly - obj[0] + 16) & (height - 1);
+    if (obj[3] & (1 << 6)) {
+        // Y flip
+        row = height - 1 - row;
+    }
+    u8 tile_id = height == 16 ? obj[2] & 0xFE : obj[2];
+    u8 lo, hi, pixels[8];
+    get_tile_row(gb->vram, tile_id, row, &lo, &hi);
+    get_tile_kernels()->decode_rows(&lo, &hi, 1, pixels);
+
+    bool x_flip = obj[3] & (1 << 5);
+    for (int p = 0; p < 8; p++) {
+        int slot = obj[1] - 8 + p - f->x;
+        if (slot < 0 || slot >= 8) {
+            // Off the left edge of the screen
+            continue;
+        }
+        u8 i = (f->obj_head + slot) % 8;
+        u8 pixel = pixels[x_flip ? 7 - p : p];
+        if (pixel && !f->obj[i]) {
+            f->obj[i] = pixel;
+            f->obj_attrs[i] = obj[3];
+        }
+    }
+    f->obj_fetched[f->obj_fetch] = true;
+    f->obj_fetch = -1;
+}
+
+static void fifo_end_line(GameBoy* gb) {
+    PixelFifo* f = &gb->fifo;
+    f->active = false;
+    if (f->in_win) {
+        gb->win_line++;
+    }
+    if (!gb->skip_video) {
+        // Palettes were applied per pixel, so the line holds shades
+        u32 lut[16];
+        for (size_t i = 0; i < 16; i++) {
+            lut[i] = fbuf_pixel(gb->fbuf_format, i & 3);
+        }
+        write_fbuf_line(gb->fbuf, gb->fbuf_format, lut, gb->ly, f->line);
+        if (gb->hash_video) {
+            hash_lines(gb);
+        }
+    }
+    set_mode(gb, MODE_HBLANK, LINE_END);
+}
+
+// Mix the next object pixel over a BG color and output it
+static void fifo_output(GameBoy* gb, u8 color) {
+    PixelFifo* f = &gb->fifo;
+    u8 slot = f->obj_head;
+    u8 pixel = f->obj[slot];
+    u8 attrs = f->obj_attrs[slot];
+    f->obj[slot] = 0;
+    f->obj_head = (slot + 1) % 8;
 
-    if (gb->ly < SCREEN_HEIGHT && gb->dots < SCREEN_WIDTH && gb->dots >= 0) {
-        // Cast is safe, check ensures that dots will always be in u8 range
-        render_pixel(gb, (u8)gb->dots, gb->ly);
+    // With the background disabled, the DMG shows blank white instead
+    u8 shade = 0;
+    if (gb->bg_en) {
+        shade = gb->bgp[color];
+    } else {
+        color = 0;
+    }
+    if (pixel && gb->obj_en && !((attrs & (1 << 7)) && color)) {
+        shade = (attrs & (1 << 4)) ? gb->obp1[pixel] : gb->obp0[pixel];
+    }
+
+    f->line[f->x++] = shade;
+    if (f->x == SCREEN_WIDTH) {
+        fifo_end_line(gb);
+    }
+}
+
+static void fifo_dot(GameBoy* gb) {
+    PixelFifo* f = &gb->fifo;
+    if (f->obj_fetch >= 0) {
+        // The BG fetcher and pixel output are paused meanwhile
+        fifo_fetch_obj(gb);
+        return;
+    }
+
+    s8 obj = fifo_next_obj(gb);
+    fifo_fetch_bg(gb);
+    if (obj >= 0) {
+        // Output stops until the object is fetched, which itself waits for
+        // the BG fetcher to be reading its tile's high byte
+        if (f->fetch_step >= 5 && f->bg_len) {
+            f->obj_fetch = obj;
+            f->obj_step = 0;
+            fifo_fetch_obj(gb);
+        }
+        return;
+    }
+    if (!f->bg_len) {
+        return;
+    }
+
+    // On the DMG, the BG enable bit also hides the window
+    if (!f->in_win && gb->bg_en && gb->win_en && gb->wy_hit &&
+        f->x + 7 >= gb->wx) {
+        // The FIFO is cleared and the fetcher restarts on the window's
+        // first tile. WX below 7 cuts off its first pixels.
+        f->in_win = true;
+        f->bg_len = 0;
+        f->fetch_step = 0;
+        f->fetch_x = 0;
+        if (gb->wx < 7) {
+            f->discard = 7 - gb->wx;
+        }
+        fifo_fetch_bg(gb);
+        return;
+    }
+
+    u8 color = f->bg[8 - f->bg_len--];
+    if (f->discard) {
+        f->discard--;
+        return;
+    }
+    fifo_output(gb, color);
+}
+
+void set_ppu_backend(GameBoy* gb, PPUBackend backend) {
+    if (backend == PPU_FIFO) {
+        // Lines can only be drawn as they happen
+        stop_render_thread(gb);
+        stop_deferred_video(gb);
+    }
+    // A line already started keeps its backend
+    gb->ppu_backend = backend;
+}
+
+void set_lcd_enabled(GameBoy* gb, bool enabled) {
+    if (enabled == gb->lcd_en) {
+        return;
+    }
+    gb->lcd_en = enabled;
+    gb->ly = 0;
+    gb->win_line = 0;
+    gb->wy_hit = false;
+    gb->fifo.active = false;
+    if (!enabled) {
+        // Nothing runs while the LCD is off, so no STAT source is active
+        gb->dots = 0;
+        gb->stat_mode = MODE_HBLANK;
+        gb->mode_end = LINE_END;
+        gb->stat_irq_line = false;
+        return;
+    }
+    // Lines drawn before the LCD went off are drawn again
+    gb->dots = -80;
+    hash_begin(&gb->line_hash);
+    set_mode(gb, MODE_OAM_SCAN, 0);
+}
+
+void lcd_cycle(GameBoy* gb) {
+    // The FIFO backend ends mode 3 itself, on the dot the last pixel is out
+    for (int i = 0; i < 4 && gb->fifo.active; i++) {
+        fifo_dot(gb);
+    }
+
+    gb->dots += 4;
+    // Only the end of mode 3 can fall between M-cycles, it is seen on the
+    // next one
+    while (gb->dots >= gb->mode_end) {
+        switch (gb->stat_mode) {
+        case MODE_OAM_SCAN: {
+            if (gb->ly == gb->wy) {
+                gb->wy_hit = true;
+            }
+            if (gb->ppu_backend == PPU_FIFO) {
+                // Ended by fifo_dot()
+                fifo_start_line(gb);
+                set_mode(gb, MODE_DRAW, LINE_END);
+                break;
+            }
+            // Mode 3's length is fixed by the end of the OAM scan
+            LineState state;
+            capture_line(gb, &state);
+            set_mode(gb, MODE_DRAW, mode3_length(&state, gb->oam));
+            // The whole line is drawn at once, as pixel output starts.
+            // Deferred drawing catches up at V-Blank instead.
+            if (!gb->video_log && !gb->skip_video) {
+                render_line(gb, &state);
+            }
+            break;
+        }
+        case MODE_DRAW:
+            set_mode(gb, MODE_HBLANK, LINE_END);
+            break;
+        default:
+            next_line(gb);
+            break;
+        }
     }
 }
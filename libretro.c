@@ -1,26 +1,124 @@
 #include "libretro.h"
+#include "audio_out.h"
+#include "fbuf.h"
 #include "gb.h"
+#include "lcd.h"
+#include "profile.h"
+#include "render_thread.h"
+#include "string.h"
+#include "video_log.h"
 
 GameBoy* gb;
 
 static retro_environment_t environ_cb;
 static retro_video_refresh_t video_cb;
-static retro_audio_sample_t audio_cb;
+static retro_audio_sample_batch_t audio_batch_cb;
 static retro_input_poll_t input_poll_cb;
 static retro_input_state_t input_state_cb;
+static retro_log_printf_t log_cb;
+
+// Negotiated with the frontend in retro_set_environment
+static FBufFormat fbuf_format;
+
+// Whether the frontend accepts a NULL frame as a repeat of the last one
+static bool can_dupe;
+
+#if RONDO_STATS
+// Stats are logged at debug level this often, and once more on unload
+#define STATS_LOG_INTERVAL 600
+
+static void log_stats(enum retro_log_level level) {
+    static const char* region_names[REGION_COUNT] = {
+        "rom", "vram", "cartram", "wram", "oam", "unused", "io", "hram", "ie"};
+
+    if (!log_cb) {
+        return;
+    }
+    const GBStats* stats = get_stats(gb);
+    if (!stats->frames) {
+        return;
+    }
+
+    log_cb(level,
+           "[Rondo] %llu frames, %llu instructions, %llu cycles, %llu audio "
+           "samples\n",
+           (unsigned long long)stats->frames,
+           (unsigned long long)stats->instructions,
+           (unsigned long long)stats->cycles,
+           (unsigned long long)stats->audio_samples);
+
+    double frames = (double)stats->frames;
+    double frame_ms = stats->frame_ns / frames / 1e6;
+    double lcd_ms = stats->lcd_ns / frames / 1e6;
+    double apu_ms = stats->apu_ns / frames / 1e6;
+    double cpu_ms = frame_ms - lcd_ms - apu_ms;
+    log_cb(level,
+           "[Rondo] ms/frame: total %.3f, lcd %.3f, apu %.3f, cpu+bus %.3f\n",
+           frame_ms, lcd_ms, apu_ms, cpu_ms > 0 ? cpu_ms : 0);
+
+    for (size_t i = 0; i < REGION_COUNT; i++) {
+        log_cb(level, "[Rondo] %-7s reads %llu, writes %llu\n",
+               region_names[i], (unsigned long long)stats->reads[i],
+               (unsigned long long)stats->writes[i]);
+    }
+
+    size_t hot_read = 0, hot_write = 0;
+    for (size_t i = 0; i < 0x80; i++) {
+        if (stats->io_reads[i] > stats->io_reads[hot_read]) {
+            hot_read = i;
+        }
+        if (stats->io_writes[i] > stats->io_writes[hot_write]) {
+            hot_write = i;
+        }
+    }
+    log_cb(level,
+           "[Rondo] hottest IO: read FF%02X (%llu), write FF%02X (%llu)\n",
+           (unsigned)hot_read, (unsigned long long)stats->io_reads[hot_read],
+           (unsigned)hot_write,
+           (unsigned long long)stats->io_writes[hot_write]);
+}
+#endif
 
 void retro_set_environment(retro_environment_t cb) {
-    static enum retro_pixel_format format = RETRO_PIXEL_FORMAT_XRGB8888;
-    cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &format);
+    struct retro_log_callback logging;
+    if (cb(RETRO_ENVIRONMENT_GET_LOG_INTERFACE, &logging)) {
+        log_cb = logging.log;
+    }
+
+    // RGB565 halves framebuffer bandwidth, so prefer it when the frontend
+    // accepts it
+    enum retro_pixel_format format = RETRO_PIXEL_FORMAT_RGB565;
+    if (cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &format)) {
+        fbuf_format = FBUF_RGB565;
+    } else {
+        format = RETRO_PIXEL_FORMAT_XRGB8888;
+        cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &format);
+        fbuf_format = FBUF_XRGB8888;
+    }
+    if (log_cb) {
+        log_cb(RETRO_LOG_INFO, "[Rondo] Pixel format: %s\n",
+               fbuf_format == FBUF_RGB565 ? "RGB565" : "XRGB8888");
+    }
+
+    static const struct retro_variable vars[] = {
+        {"rondo_ppu", "PPU; scanline|fifo"},
+#if !RONDO_RENDER_THREAD
+        {"rondo_video", "Line drawing; direct|deferred"},
+#endif
+        {NULL, NULL},
+    };
+    cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void*)vars);
 
     environ_cb = cb;
 }
 
 void retro_set_video_refresh(retro_video_refresh_t cb) { video_cb = cb; }
 
-void retro_set_audio_sample(retro_audio_sample_t cb) { audio_cb = cb; }
+void retro_set_audio_sample(retro_audio_sample_t cb) {}
 
-void retro_set_audio_sample_batch(retro_audio_sample_batch_t cb) {}
+void retro_set_audio_sample_batch(retro_audio_sample_batch_t cb) {
+    audio_batch_cb = cb;
+}
 
 void retro_set_input_poll(retro_input_poll_t cb) { input_poll_cb = cb; }
 
@@ -48,7 +146,7 @@ void retro_get_system_av_info(struct retro_system_av_info* info) {
     info->geometry.aspect_ratio = 0; // Interpreted as base_width/base_height
 
     info->timing.fps = FRAME_RATE;
-    info->timing.sample_rate = 1048576.0; // Placeholder
+    info->timing.sample_rate = AUDIO_OUT_RATE;
 }
 
 void retro_set_controller_port_device(unsigned port, unsigned device) {}
@@ -75,11 +173,91 @@ static void update_input() {
     gb->input = ~input;
 }
 
+static void update_options() {
+    struct retro_variable var = {"rondo_ppu", NULL};
+    PPUBackend backend = PPU_SCANLINE;
+    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value &&
+        !strcmp(var.value, "fifo")) {
+        backend = PPU_FIFO;
+    }
+    if (backend != gb->ppu_backend) {
+        set_ppu_backend(gb, backend);
+        if (log_cb) {
+            log_cb(RETRO_LOG_INFO, "[Rondo] PPU: %s\n",
+                   backend == PPU_FIFO ? "fifo" : "scanline");
+        }
+    }
+
+#if !RONDO_RENDER_THREAD
+    // Deferred drawing is refused with the FIFO backend, so asking again after
+    // a backend change picks it back up. The render thread owns the video log
+    // when built in, so the option only exists without it.
+    var = (struct retro_variable){"rondo_video", NULL};
+    bool was_deferred = gb->deferred_video;
+    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value &&
+        !strcmp(var.value, "deferred")) {
+        start_deferred_video(gb);
+    } else {
+        stop_deferred_video(gb);
+    }
+    if (!gb->deferred_video != !was_deferred && log_cb) {
+        log_cb(RETRO_LOG_INFO, "[Rondo] Line drawing: %s\n",
+               gb->deferred_video ? "deferred" : "direct");
+    }
+#endif
+}
+
+// Frontends that support it report their buffer fill before each retro_run,
+// which steers the resampling ratio (dynamic rate control)
+static void RETRO_CALLCONV audio_buffer_status(bool active, unsigned occupancy,
+                                               bool underrun_likely) {
+    if (!gb) {
+        return;
+    }
+    if (active) {
+        set_audio_fill(gb->audio_out, occupancy);
+    } else {
+        reset_audio_rate(gb->audio_out);
+    }
+}
+
+// Hand everything resampled during the frame to the frontend
+static void flush_audio() {
+    s16 frames[1024][2];
+    size_t count;
+    while ((count = pop_audio(gb->audio_out, frames[0], 1024))) {
+        audio_batch_cb(frames[0], count);
+    }
+}
+
 void retro_run(void) {
+    bool options_changed = false;
+    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &options_changed) &&
+        options_changed) {
+        update_options();
+    }
     update_input();
+
+    // The frontend may tell us it will throw away this frame's output
+    int av_enable = RETRO_AV_ENABLE_VIDEO | RETRO_AV_ENABLE_AUDIO;
+    if (!environ_cb(RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE, &av_enable)) {
+        av_enable = RETRO_AV_ENABLE_VIDEO | RETRO_AV_ENABLE_AUDIO;
+    }
+    gb->skip_video = !(av_enable & RETRO_AV_ENABLE_VIDEO);
+    gb->no_audio = !(av_enable & RETRO_AV_ENABLE_AUDIO);
+
     run_frame(gb);
+    flush_audio();
+
+    // Skipped frames left fbuf stale, so report a dupe where we can
+    const void* frame = gb->skip_video && can_dupe ? NULL : gb->fbuf;
+    video_cb(frame, SCREEN_WIDTH, SCREEN_HEIGHT, fbuf_pitch(gb->fbuf_format));
 
-    video_cb(gb->fbuf, SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_WIDTH * sizeof(u32));
+#if RONDO_STATS
+    if (!(get_stats(gb)->frames % STATS_LOG_INTERVAL)) {
+        log_stats(RETRO_LOG_DEBUG);
+    }
+#endif
 }
 
 size_t retro_serialize_size(void) { return 0; }
@@ -103,6 +281,23 @@ bool retro_load_game(const struct retro_game_info* game) {
     if (!gb) {
         return false;
     }
+    set_fbuf_format(gb, fbuf_format);
+    update_options();
+    if (!environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &can_dupe)) {
+        can_dupe = false;
+    }
+    struct retro_audio_buffer_status_callback status = {audio_buffer_status};
+    if (!environ_cb(RETRO_ENVIRONMENT_SET_AUDIO_BUFFER_STATUS_CALLBACK,
+                    &status) &&
+        log_cb) {
+        log_cb(RETRO_LOG_INFO,
+               "[Rondo] No audio buffer status, resampling at a fixed rate\n");
+    }
+#if RONDO_RENDER_THREAD
+    if (!start_render_thread(gb) && log_cb) {
+        log_cb(RETRO_LOG_WARN, "[Rondo] Drawing on the emulation thread\n");
+    }
+#endif
 
     return true;
 }
@@ -114,6 +309,13 @@ bool retro_load_game_special(unsigned game_type,
 }
 
 void retro_unload_game(void) {
+    environ_cb(RETRO_ENVIRONMENT_SET_AUDIO_BUFFER_STATUS_CALLBACK, NULL);
+#if RONDO_STATS
+    log_stats(RETRO_LOG_INFO);
+#endif
+#if RONDO_PROFILE
+    prof_dump(gb, "rondo_profile.txt");
+#endif
     destroy_gb(gb);
     gb = NULL;
 }
@@ -123,6 +325,3 @@ unsigned retro_get_region(void) { return 0; }
 void* retro_get_memory_data(unsigned id) { return NULL; }
 
 size_t retro_get_memory_size(unsigned id) { return 0; }
-
-// Used in apu.c
-void play_sample(s16 l, s16 r) { audio_cb(l, r); }
@@ -0,0 +1,274 @@
+#include "movie.h"
+
+#include "fbuf.h"
+#include "hash.h"
+#include "lcd.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "video_log.h"
+
+// Defined in gb.c
+void* crit_alloc(size_t size);
+
+static void get_checksums(u8* rom, u16* rom_checksum, u8* header_checksum) {
+    *rom_checksum = rom[0x014E] << 8 | rom[0x014F];
+    *header_checksum = rom[0x014D];
+}
+
+Movie* make_movie(GameBoy* gb, u32 checkpoint_interval) {
+    if (!checkpoint_interval) {
+        printf("Movie checkpoint interval must not be 0\n");
+        return NULL;
+    }
+    if (gb->render_thread) {
+        printf("Movies can't be recorded with the render thread running\n");
+        return NULL;
+    }
+
+    Movie* movie = crit_alloc(sizeof(Movie));
+    get_checksums(gb->rom_lo, &movie->rom_checksum, &movie->header_checksum);
+    movie->fbuf_format = gb->fbuf_format;
+    movie->ppu_backend = gb->ppu_backend;
+    movie->deferred_video = gb->deferred_video;
+    movie->checkpoint_interval = checkpoint_interval;
+    return movie;
+}
+
+void destroy_movie(Movie* movie) {
+    free(movie->inputs);
+    free(movie->hashes);
+    free(movie);
+}
+
+// Grow the input and hash arrays so that they can hold `frames` frames
+static bool reserve_frames(Movie* movie, u32 frames) {
+    if (frames <= movie->frame_capacity) {
+        return true;
+    }
+    if (frames > MOVIE_MAX_FRAMES) {
+        return false;
+    }
+    // Can't overflow, frames is at most MOVIE_MAX_FRAMES
+    size_t capacity = movie->frame_capacity ? movie->frame_capacity : 1024;
+    while (capacity < frames) {
+        capacity *= 2;
+    }
+    if (capacity > MOVIE_MAX_FRAMES) {
+        capacity = MOVIE_MAX_FRAMES;
+    }
+
+    u8* inputs = realloc(movie->inputs, capacity);
+    if (!inputs) {
+        return false;
+    }
+    movie->inputs = inputs;
+    size_t checkpoints = capacity / movie->checkpoint_interval + 1;
+    u64* hashes = realloc(movie->hashes, checkpoints * sizeof(u64));
+    if (!hashes) {
+        return false;
+    }
+    movie->hashes = hashes;
+    movie->frame_capacity = (u32)capacity;
+    return true;
+}
+
+void movie_record_frame(Movie* movie, GameBoy* gb) {
+    if (!reserve_frames(movie, movie->frame_count + 1)) {
+        printf("Memory allocation failed!");
+        exit(1);
+    }
+    movie->inputs[movie->frame_count++] = gb->input;
+    if (!(movie->frame_count % movie->checkpoint_interval)) {
+        movie->hashes[movie->frame_count / movie->checkpoint_interval - 1] =
+            hash_fbuf(gb);
+    }
+}
+
+static void put_u16(FILE* file, u16 value) {
+    fputc(value & 0xFF, file);
+    fputc(value >> 8, file);
+}
+
+static void put_u32(FILE* file, u32 value) {
+    put_u16(file, value & 0xFFFF);
+    put_u16(file, value >> 16);
+}
+
+static void put_u64(FILE* file, u64 value) {
+    put_u32(file, value & 0xFFFFFFFF);
+    put_u32(file, value >> 32);
+}
+
+bool save_movie(Movie* movie, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        printf("Could not open %s for writing\n", path);
+        return false;
+    }
+
+    fwrite("RDMV", 1, 4, file);
+    put_u16(file, MOVIE_VERSION);
+    put_u16(file, movie->rom_checksum);
+    fputc(movie->header_checksum, file);
+    fputc(movie->fbuf_format, file);
+    fputc(movie->ppu_backend, file);
+    fputc(movie->deferred_video, file);
+    put_u32(file, movie->frame_count);
+    put_u32(file, movie->checkpoint_interval);
+    fwrite(movie->inputs, 1, movie->frame_count, file);
+    for (u32 i = 0; i < movie->frame_count / movie->checkpoint_interval; i++) {
+        put_u64(file, movie->hashes[i]);
+    }
+
+    bool ok = !ferror(file);
+    ok &= fclose(file) == 0;
+    return ok;
+}
+
+// Reads return 0 past the end of the file; callers check feof() once
+static u16 get_u16(FILE* file) {
+    u16 lo = fgetc(file) & 0xFF;
+    u16 hi = fgetc(file) & 0xFF;
+    return hi << 8 | lo;
+}
+
+static u32 get_u32(FILE* file) {
+    u32 lo = get_u16(file);
+    u32 hi = get_u16(file);
+    return hi << 16 | lo;
+}
+
+static u64 get_u64(FILE* file) {
+    u64 lo = get_u32(file);
+    u64 hi = get_u32(file);
+    return hi << 32 | lo;
+}
+
+Movie* load_movie(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        printf("Could not open %s\n", path);
+        return NULL;
+    }
+
+    char magic[4];
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "RDMV", 4)) {
+        printf("%s is not a Rondo movie\n", path);
+        fclose(file);
+        return NULL;
+    }
+    if (get_u16(file) != MOVIE_VERSION) {
+        printf("Unsupported movie version\n");
+        fclose(file);
+        return NULL;
+    }
+
+    u16 rom_checksum = get_u16(file);
+    u8 header_checksum = fgetc(file);
+    u8 fbuf_format = fgetc(file);
+    if (fbuf_format > FBUF_PACKED2) {
+        printf("Unknown framebuffer format in movie\n");
+        fclose(file);
+        return NULL;
+    }
+    u8 ppu_backend = fgetc(file);
+    u8 deferred_video = fgetc(file);
+    if (ppu_backend > PPU_FIFO || deferred_video > 1) {
+        printf("Unknown video mode in movie\n");
+        fclose(file);
+        return NULL;
+    }
+    u32 frame_count = get_u32(file);
+    u32 checkpoint_interval = get_u32(file);
+    if (!checkpoint_interval) {
+        printf("Movie checkpoint interval must not be 0\n");
+        fclose(file);
+        return NULL;
+    }
+    if (frame_count > MOVIE_MAX_FRAMES) {
+        printf("Movie is too long\n");
+        fclose(file);
+        return NULL;
+    }
+    // Don't size anything by the header until the file is known to hold it
+    long start = ftell(file);
+    fseek(file, 0, SEEK_END);
+    long end = ftell(file);
+    fseek(file, start, SEEK_SET);
+    u64 body_size =
+        frame_count + (u64)(frame_count / checkpoint_interval) * sizeof(u64);
+    if (start < 0 || end < start || body_size > (u64)(end - start)) {
+        printf("%s is truncated\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    Movie* movie = crit_alloc(sizeof(Movie));
+    movie->rom_checksum = rom_checksum;
+    movie->header_checksum = header_checksum;
+    movie->fbuf_format = fbuf_format;
+    movie->ppu_backend = ppu_backend;
+    movie->deferred_video = deferred_video;
+    movie->checkpoint_interval = checkpoint_interval;
+    if (!reserve_frames(movie, frame_count)) {
+        printf("Memory allocation failed!");
+        fclose(file);
+        destroy_movie(movie);
+        return NULL;
+    }
+    movie->frame_count = frame_count;
+    bool ok = fread(movie->inputs, 1, frame_count, file) == frame_count;
+    for (u32 i = 0; i < frame_count / checkpoint_interval; i++) {
+        movie->hashes[i] = get_u64(file);
+    }
+    ok &= !feof(file) && !ferror(file);
+    fclose(file);
+
+    if (!ok) {
+        printf("%s is truncated\n", path);
+        destroy_movie(movie);
+        return NULL;
+    }
+    return movie;
+}
+
+long long play_movie(Movie* movie, u8* rom, size_t size) {
+    u16 rom_checksum;
+    u8 header_checksum;
+    get_checksums(rom, &rom_checksum, &header_checksum);
+    if (rom_checksum != movie->rom_checksum ||
+        header_checksum != movie->header_checksum) {
+        printf("Movie was recorded with a different ROM\n");
+        return MOVIE_ERROR;
+    }
+
+    GameBoy* gb = make_gb(rom, size);
+    if (!gb) {
+        return MOVIE_ERROR;
+    }
+    set_fbuf_format(gb, movie->fbuf_format);
+    set_ppu_backend(gb, movie->ppu_backend);
+    if (movie->deferred_video) {
+        start_deferred_video(gb);
+    }
+    gb->no_audio = true;
+
+    long long result = MOVIE_MATCH;
+    for (u32 i = 0; i < movie->frame_count; i++) {
+        // Only frames with a checkpoint need to be drawn at all
+        bool checkpoint = !((i + 1) % movie->checkpoint_interval);
+        gb->input = movie->inputs[i];
+        gb->skip_video = !checkpoint;
+        run_frame(gb);
+        if (checkpoint &&
+            hash_fbuf(gb) !=
+                movie->hashes[(i + 1) / movie->checkpoint_interval - 1]) {
+            result = i;
+            break;
+        }
+    }
+
+    destroy_gb(gb);
+    return result;
+}
@@ -0,0 +1,73 @@
+#ifndef RONDO_MOVIE_H
+#define RONDO_MOVIE_H
+
+#include "gb.h"
+
+// Input movie: the value of gb->input for every frame since power-on, plus
+// framebuffer hashes taken every checkpoint_interval frames. Movies always
+// start from power-on. Each hash is hash_fbuf() right after the frame's
+// run_frame(), both when recording and when playing back. The PPU backend and
+// whether drawing is deferred are stored too, since the backends can draw
+// mid-line writes differently.
+//
+// Recording is only available through this API, the libretro core doesn't
+// record or play movies.
+//
+// File layout (all integers little-endian):
+//   "RDMV"                  magic
+//   u16 version             MOVIE_VERSION
+//   u16 rom_checksum        Cartridge header bytes 0x014E-0x014F
+//   u8 header_checksum      Cartridge header byte 0x014D
+//   u8 fbuf_format          FBufFormat the hashes were taken in
+//   u8 ppu_backend          PPUBackend
+//   u8 deferred_video       1 if drawing was deferred to V-Blank
+//   u32 frame_count
+//   u32 checkpoint_interval
+//   u8 inputs[frame_count]
+//   u64 hashes[frame_count / checkpoint_interval]
+#define MOVIE_VERSION 4
+
+// About 52 days at 60 frames per second
+#define MOVIE_MAX_FRAMES (1u << 28)
+
+typedef struct Movie {
+    u16 rom_checksum;
+    u8 header_checksum;
+    FBufFormat fbuf_format;
+    PPUBackend ppu_backend;
+    bool deferred_video;
+
+    u32 frame_count;
+    u32 frame_capacity;
+    u8* inputs;
+
+    // Hash i is taken after frame (i + 1) * checkpoint_interval - 1
+    u32 checkpoint_interval;
+    u64* hashes;
+} Movie;
+
+// Start a new recording from power-on, return null if there was a problem.
+// The render thread's output lags by a frame, so it can't be running. Keep
+// the framebuffer format, PPU backend and drawing mode until the recording
+// ends.
+Movie* make_movie(GameBoy* gb, u32 checkpoint_interval);
+void destroy_movie(Movie* movie);
+
+// Call after each run_frame() to append the frame's input. Checkpoint frames
+// must be run with skip_video clear.
+void movie_record_frame(Movie* movie, GameBoy* gb);
+
+bool save_movie(Movie* movie, const char* path);
+// Return null if there was a problem
+Movie* load_movie(const char* path);
+
+#define MOVIE_MATCH -1
+#define MOVIE_ERROR -2
+
+// Replay the movie from power-on as fast as possible, with no frontend
+// callbacks. Return MOVIE_MATCH if every checkpoint matched, MOVIE_ERROR if
+// the movie could not be played, otherwise the frame at which the first
+// mismatching checkpoint was taken.
+long long play_movie(Movie* movie, u8* rom, size_t size);
+
+#endif
@@ -0,0 +1,141 @@
+#include "profile.h"
+
+#if RONDO_PROFILE
+
+#include "stdio.h"
+#include "stdlib.h"
+
+// Defined in gb.c
+void* crit_alloc(size_t size);
+
+Profile* prof_create(void) { return crit_alloc(sizeof(Profile)); }
+
+void prof_destroy(Profile* prof) {
+    if (!prof) {
+        return;
+    }
+    for (size_t i = 0; i < PROF_MAX_BANKS; i++) {
+        free(prof->banked[i]);
+    }
+    free(prof);
+}
+
+static ProfEntry* get_pc_entry(GameBoy* gb, u16 pc) {
+    Profile* prof = gb->prof;
+    if (pc < 0x4000 || pc >= 0x8000) {
+        return &prof->fixed[pc];
+    }
+
+    size_t bank = (size_t)(gb->rom_hi - gb->rom_lo) / 0x4000;
+    if (bank >= PROF_MAX_BANKS) {
+        bank = PROF_MAX_BANKS - 1;
+    }
+    if (!prof->banked[bank]) {
+        prof->banked[bank] = crit_alloc(0x4000 * sizeof(ProfEntry));
+    }
+    return &prof->banked[bank][pc - 0x4000];
+}
+
+void prof_record(GameBoy* gb, u16 pc, u8 opcode, u64 cycles) {
+    Profile* prof = gb->prof;
+
+    ProfEntry* entry = get_pc_entry(gb, pc);
+    entry->count++;
+    entry->cycles += cycles;
+
+    entry =
+        opcode == 0xCB ? &prof->cb_ops[prof->cb_opcode] : &prof->ops[opcode];
+    entry->count++;
+    entry->cycles += cycles;
+}
+
+void prof_record_irq(GameBoy* gb, u64 cycles) {
+    gb->prof->irq.count++;
+    gb->prof->irq.cycles += cycles;
+}
+
+typedef struct {
+    u16 bank;
+    u16 pc;
+    ProfEntry entry;
+} PCSample;
+
+// Sort by descending cycle count
+static int compare_samples(const void* a, const void* b) {
+    u64 ca = ((const PCSample*)a)->entry.cycles;
+    u64 cb = ((const PCSample*)b)->entry.cycles;
+    return (ca < cb) - (ca > cb);
+}
+
+static size_t collect(PCSample* out, size_t n, const ProfEntry* entries,
+                      size_t count, u16 bank, u16 base) {
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].count) {
+            out[n].bank = bank;
+            out[n].pc = (u16)(base + i);
+            out[n].entry = entries[i];
+            n++;
+        }
+    }
+    return n;
+}
+
+static void dump_ops(FILE* file, const char* prefix, const ProfEntry* ops) {
+    for (size_t i = 0; i < 256; i++) {
+        if (ops[i].count) {
+            fprintf(file, "%s%02X %llu %llu\n", prefix, (unsigned)i,
+                    (unsigned long long)ops[i].count,
+                    (unsigned long long)ops[i].cycles);
+        }
+    }
+}
+
+bool prof_dump(GameBoy* gb, const char* path) {
+    Profile* prof = gb->prof;
+
+    // Upper bound: every fixed address plus every allocated bank
+    size_t max_samples = 0x10000;
+    for (size_t i = 0; i < PROF_MAX_BANKS; i++) {
+        if (prof->banked[i]) {
+            max_samples += 0x4000;
+        }
+    }
+    PCSample* samples = malloc(max_samples * sizeof(PCSample));
+    if (!samples) {
+        return false;
+    }
+
+    size_t n = collect(samples, 0, prof->fixed, 0x10000, 0, 0);
+    for (size_t i = 0; i < PROF_MAX_BANKS; i++) {
+        if (prof->banked[i]) {
+            n = collect(samples, n, prof->banked[i], 0x4000, (u16)i, 0x4000);
+        }
+    }
+    qsort(samples, n, sizeof(PCSample), compare_samples);
+
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        free(samples);
+        return false;
+    }
+
+    // One record per line, fields separated by spaces, cycles are M-cycles
+    fprintf(file, "# rondo profile v1\n");
+    fprintf(file, "total_cycles %llu\n", (unsigned long long)prof->cycles);
+    fprintf(file, "irq %llu %llu\n", (unsigned long long)prof->irq.count,
+            (unsigned long long)prof->irq.cycles);
+    fprintf(file, "# pc <bank>:<addr> <count> <cycles>\n");
+    for (size_t i = 0; i < n; i++) {
+        fprintf(file, "pc %03X:%04X %llu %llu\n", samples[i].bank,
+                samples[i].pc, (unsigned long long)samples[i].entry.count,
+                (unsigned long long)samples[i].entry.cycles);
+    }
+    fprintf(file, "# op <opcode> <count> <cycles>\n");
+    dump_ops(file, "op ", prof->ops);
+    dump_ops(file, "op CB", prof->cb_ops);
+
+    free(samples);
+    return fclose(file) == 0;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef RONDO_PROFILE_H
+#define RONDO_PROFILE_H
+
+#include "gb.h"
+
+#if RONDO_PROFILE
+
+#define PROF_MAX_BANKS 512
+
+typedef struct ProfEntry {
+    u64 count;
+    u64 cycles; // M-cycles
+} ProfEntry;
+
+typedef struct Profile {
+    // Running M-cycle count, bumped by cycle()
+    u64 cycles;
+    // Set by op_cb so that CB-prefixed opcodes get their own histogram
+    u8 cb_opcode;
+
+    // Indexed by PC for everything outside of 0x4000-0x7FFF
+    ProfEntry fixed[0x10000];
+    // Indexed by PC - 0x4000 for each switchable ROM bank, allocated on use
+    ProfEntry* banked[PROF_MAX_BANKS];
+
+    ProfEntry ops[256];
+    ProfEntry cb_ops[256];
+    ProfEntry irq;
+} Profile;
+
+Profile* prof_create(void);
+void prof_destroy(Profile* prof);
+
+// Called by run_opcode once an instruction (or interrupt dispatch) finishes
+void prof_record(GameBoy* gb, u16 pc, u8 opcode, u64 cycles);
+void prof_record_irq(GameBoy* gb, u64 cycles);
+
+// Write the collected profile to a flat text file, return false on failure
+bool prof_dump(GameBoy* gb, const char* path);
+
+#endif
+
+#endif
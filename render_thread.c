@@ -0,0 +1,168 @@
+#include "render_thread.h"
+
+#if RONDO_RENDER_THREAD
+
+#include "fbuf.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "threads.h"
+#include "video_log.h"
+
+// Defined in gb.c
+void* crit_alloc(size_t size);
+
+typedef struct RenderThread {
+    thrd_t thread;
+    mtx_t lock;
+    cnd_t cond;
+    bool quit;
+
+    // recording is filled by the emulation thread while pending, if not null,
+    // is being replayed. Both point into logs.
+    VideoLog logs[2];
+    VideoLog* recording;
+    VideoLog* pending;
+    bool draw_pending; // Whether pending should be drawn or only replayed
+
+    // Owned by the render thread while a frame is pending
+    VideoReplay replay;
+    void* back;
+    bool back_complete; // back holds a finished frame that isn't shown yet
+    void* home;         // gb->fbuf when the thread started, in the arena
+} RenderThread;
+
+static int render_main(void* arg) {
+    RenderThread* rt = arg;
+    mtx_lock(&rt->lock);
+    while (true) {
+        while (!rt->pending && !rt->quit) {
+            cnd_wait(&rt->cond, &rt->lock);
+        }
+        if (rt->quit) {
+            break;
+        }
+        mtx_unlock(&rt->lock);
+        replay_video_log(&rt->replay, rt->pending, rt->back, rt->draw_pending);
+        rt->back_complete = rt->draw_pending;
+        mtx_lock(&rt->lock);
+        rt->pending = NULL;
+        cnd_broadcast(&rt->cond);
+    }
+    mtx_unlock(&rt->lock);
+    return 0;
+}
+
+bool start_render_thread(GameBoy* gb) {
+    if (gb->render_thread) {
+        return true;
+    }
+    if (gb->ppu_backend == PPU_FIFO) {
+        printf("The FIFO PPU draws on the emulation thread\n");
+        return false;
+    }
+    if (gb->hash_video) {
+        printf("Frame hashes need drawing on the emulation thread\n");
+        return false;
+    }
+    // Both modes replay the same log, only one of them may own it
+    stop_deferred_video(gb);
+
+    RenderThread* rt = crit_alloc(sizeof(RenderThread));
+    init_video_replay(&rt->replay, gb);
+    // Sized like the arena's fbuf, since either can end up as gb->fbuf
+    rt->back = crit_alloc(FBUF_MAX_SIZE);
+    rt->home = gb->fbuf;
+    rt->recording = &rt->logs[0];
+
+    if (mtx_init(&rt->lock, mtx_plain) != thrd_success) {
+        printf("Could not create render thread mutex\n");
+        free(rt->back);
+        free(rt);
+        return false;
+    }
+    if (cnd_init(&rt->cond) != thrd_success) {
+        printf("Could not create render thread condition variable\n");
+        mtx_destroy(&rt->lock);
+        free(rt->back);
+        free(rt);
+        return false;
+    }
+    if (thrd_create(&rt->thread, render_main, rt) != thrd_success) {
+        printf("Could not start render thread\n");
+        cnd_destroy(&rt->cond);
+        mtx_destroy(&rt->lock);
+        free(rt->back);
+        free(rt);
+        return false;
+    }
+
+    gb->render_thread = rt;
+    gb->video_log = rt->recording;
+    return true;
+}
+
+void stop_render_thread(GameBoy* gb) {
+    RenderThread* rt = gb->render_thread;
+    if (!rt) {
+        return;
+    }
+
+    mtx_lock(&rt->lock);
+    rt->quit = true;
+    cnd_broadcast(&rt->cond);
+    mtx_unlock(&rt->lock);
+    thrd_join(rt->thread, NULL);
+
+    cnd_destroy(&rt->cond);
+    mtx_destroy(&rt->lock);
+    destroy_video_log(&rt->logs[0]);
+    destroy_video_log(&rt->logs[1]);
+    // Put the shown frame back into the instance's own buffer before freeing
+    // the other one
+    if (gb->fbuf != rt->home) {
+        memcpy(rt->home, gb->fbuf, fbuf_size(gb->fbuf_format));
+        rt->back = gb->fbuf;
+        gb->fbuf = rt->home;
+    }
+    free(rt->back);
+    free(rt);
+    gb->render_thread = NULL;
+    gb->video_log = NULL;
+}
+
+void submit_render_frame(GameBoy* gb) {
+    RenderThread* rt = gb->render_thread;
+    mtx_lock(&rt->lock);
+    while (rt->pending) {
+        cnd_wait(&rt->cond, &rt->lock);
+    }
+
+    // The previous frame is finished. Put it on screen, and draw this one
+    // over the frame it replaces.
+    if (rt->back_complete) {
+        void* front = gb->fbuf;
+        gb->fbuf = rt->back;
+        rt->back = front;
+        rt->back_complete = false;
+    }
+
+    rt->pending = rt->recording;
+    rt->draw_pending = !gb->skip_video;
+    rt->recording = rt->pending == &rt->logs[0] ? &rt->logs[1] : &rt->logs[0];
+    rt->recording->count = 0;
+    gb->video_log = rt->recording;
+    cnd_broadcast(&rt->cond);
+    mtx_unlock(&rt->lock);
+}
+
+#else
+
+// Default builds don't depend on C11 threads
+bool start_render_thread(GameBoy* gb) { return false; }
+
+void stop_render_thread(GameBoy* gb) {}
+
+void submit_render_frame(GameBoy* gb) {}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef RONDO_RENDER_THREAD_H
+#define RONDO_RENDER_THREAD_H
+
+#include "gb.h"
+
+// Optional pipelined renderer. The emulation thread keeps a video log (see
+// video_log.h), and at V-Blank hands the frame's log to a second thread. That
+// thread replays it and draws the lines into a back buffer while the next
+// frame is emulated.
+//
+// gb->fbuf always holds the last fully drawn frame, so output lags emulation
+// by one frame. That leaves nothing for frame_hash to follow, so the thread
+// won't start while gb->hash_video is set. set_fbuf_format() restarts it.
+
+// Return false if the thread could not be started, or always unless built
+// with RONDO_RENDER_THREAD=1
+bool start_render_thread(GameBoy* gb);
+// Does nothing if no thread is running
+void stop_render_thread(GameBoy* gb);
+
+// Called by ldc.c at the start of V-Blank while gb->render_thread is set
+void submit_render_frame(GameBoy* gb);
+
+#endif
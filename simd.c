@@ -0,0 +1,29 @@
+#include "simd.h"
+
+#if RONDO_X86 && defined(_MSC_VER)
+#include "intrin.h"
+#endif
+
+bool cpu_has_avx2(void) {
+#if RONDO_X86 && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    // The OS also has to save the YMM registers on context switches
+    __cpuid(info, 1);
+    bool osxsave = info[2] & (1 << 27);
+    bool avx = info[2] & (1 << 28);
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return info[1] & (1 << 5);
+#elif RONDO_X86 && defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
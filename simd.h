@@ -0,0 +1,39 @@
+#ifndef RONDO_SIMD_H
+#define RONDO_SIMD_H
+
+// Compile-time detection of the SIMD instruction sets the core can use.
+// RONDO_SSE2 code may be used unconditionally, RONDO_AVX2 code has to be
+// picked at runtime after checking cpu_has_avx2().
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) ||             \
+    defined(_M_IX86)
+#define RONDO_X86 1
+#else
+#define RONDO_X86 0
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RONDO_SSE2 1
+#include "emmintrin.h"
+#else
+#define RONDO_SSE2 0
+#endif
+
+#if RONDO_X86 && (defined(__GNUC__) || defined(_MSC_VER))
+#define RONDO_AVX2 1
+#include "immintrin.h"
+#if defined(__GNUC__)
+#define RONDO_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define RONDO_TARGET_AVX2
+#endif
+#else
+#define RONDO_AVX2 0
+#endif
+
+#include "stdbool.h"
+
+bool cpu_has_avx2(void);
+
+#endif
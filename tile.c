@@ -0,0 +1,199 @@
+#include "tile.h"
+
+#include "simd.h"
+#include "string.h"
+
+// Threads that race on the first call all pick the same kernels, so the
+// pointer only has to be published atomically. MSVC only has stdatomic.h with
+// /experimental:c11atomics.
+#if defined(_MSC_VER) && !defined(__clang__)
+#include "intrin.h"
+
+static void* volatile selected;
+
+static const TileKernels* load_selected(void) {
+    return _InterlockedCompareExchangePointer(&selected, NULL, NULL);
+}
+
+static void store_selected(const TileKernels* kernels) {
+    _InterlockedExchangePointer(&selected, (void*)kernels);
+}
+#else
+#include "stdatomic.h"
+
+static _Atomic(const TileKernels*) selected;
+
+static const TileKernels* load_selected(void) {
+    return atomic_load_explicit(&selected, memory_order_acquire);
+}
+
+static void store_selected(const TileKernels* kernels) {
+    atomic_store_explicit(&selected, kernels, memory_order_release);
+}
+#endif
+
+// Scalar fallback
+
+// spread[b] holds bit 7 of b in byte 0, bit 6 in byte 1 and so on. Shifting
+// the whole word left by one moves every byte's 0/1 to 0/2 without carries.
+// Built at compile time so that no instance has to initialize it.
+#define SPREAD(b)                                                              \
+    {(b) >> 7 & 1, (b) >> 6 & 1, (b) >> 5 & 1, (b) >> 4 & 1,                   \
+     (b) >> 3 & 1, (b) >> 2 & 1, (b) >> 1 & 1, (b) & 1}
+#define SPREAD4(b) SPREAD(b), SPREAD((b) + 1), SPREAD((b) + 2), SPREAD((b) + 3)
+#define SPREAD16(b)                                                            \
+    SPREAD4(b), SPREAD4((b) + 4), SPREAD4((b) + 8), SPREAD4((b) + 12)
+#define SPREAD64(b)                                                            \
+    SPREAD16(b), SPREAD16((b) + 16), SPREAD16((b) + 32), SPREAD16((b) + 48)
+
+static const u8 spread[256][8] = {SPREAD64(0), SPREAD64(64), SPREAD64(128),
+                                  SPREAD64(192)};
+
+static void decode_rows_scalar(const u8* lo, const u8* hi, size_t count,
+                               u8* out) {
+    for (size_t t = 0; t < count; t++) {
+        u64 lo_bits, hi_bits;
+        memcpy(&lo_bits, spread[lo[t]], sizeof(lo_bits));
+        memcpy(&hi_bits, spread[hi[t]], sizeof(hi_bits));
+        u64 pixels = lo_bits | hi_bits << 1;
+        memcpy(out + 8 * t, &pixels, sizeof(pixels));
+    }
+}
+
+static void apply_palette_scalar(const u8* in, size_t count, const u8* table,
+                                 u8* out) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = table[in[i] & 15];
+    }
+}
+
+static const TileKernels SCALAR_KERNELS = {"scalar", decode_rows_scalar,
+                                           apply_palette_scalar};
+
+#if RONDO_SSE2
+
+// Repeat each of the 16 bytes in v eight times, two tiles per output vector
+static inline void replicate_x8(__m128i v, __m128i out[8]) {
+    __m128i x2[2] = {_mm_unpacklo_epi8(v, v), _mm_unpackhi_epi8(v, v)};
+    for (int i = 0; i < 2; i++) {
+        __m128i x4_lo = _mm_unpacklo_epi16(x2[i], x2[i]);
+        __m128i x4_hi = _mm_unpackhi_epi16(x2[i], x2[i]);
+        out[4 * i + 0] = _mm_unpacklo_epi32(x4_lo, x4_lo);
+        out[4 * i + 1] = _mm_unpackhi_epi32(x4_lo, x4_lo);
+        out[4 * i + 2] = _mm_unpacklo_epi32(x4_hi, x4_hi);
+        out[4 * i + 3] = _mm_unpackhi_epi32(x4_hi, x4_hi);
+    }
+}
+
+// 16 tiles per step: replicate each plane byte across its 8 pixels, then
+// test one bit per byte and combine the two planes
+static void decode_rows_sse2(const u8* lo, const u8* hi, size_t count,
+                             u8* out) {
+    const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8,
+                                      16, 32, 64, -128);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i two = _mm_set1_epi8(2);
+
+    size_t t = 0;
+    for (; t < (count & ~(size_t)15); t += 16) {
+        __m128i lo_x8[8], hi_x8[8];
+        replicate_x8(_mm_loadu_si128((const __m128i*)(lo + t)), lo_x8);
+        replicate_x8(_mm_loadu_si128((const __m128i*)(hi + t)), hi_x8);
+        for (int i = 0; i < 8; i++) {
+            __m128i lo_set =
+                _mm_cmpeq_epi8(_mm_and_si128(lo_x8[i], bits), bits);
+            __m128i hi_set =
+                _mm_cmpeq_epi8(_mm_and_si128(hi_x8[i], bits), bits);
+            __m128i pixels = _mm_or_si128(_mm_and_si128(lo_set, one),
+                                          _mm_and_si128(hi_set, two));
+            _mm_storeu_si128((__m128i*)(out + 8 * t + 16 * i), pixels);
+        }
+    }
+    decode_rows_scalar(lo + t, hi + t, count - t, out + 8 * t);
+}
+
+// SSE2 has no byte shuffle. Extending the compare-and-select kernel to 16
+// entries measured about 25% slower per line than the scalar loop, and a
+// select tree on the index bits was no better, so keep the loop.
+static const TileKernels SSE2_KERNELS = {"sse2", decode_rows_sse2,
+                                         apply_palette_scalar};
+
+#endif
+
+#if RONDO_AVX2
+
+// 4 tiles per step: broadcast four plane bytes and let vpshufb spread each
+// across its 8 pixels
+RONDO_TARGET_AVX2
+static void decode_rows_avx2(const u8* lo, const u8* hi, size_t count,
+                             u8* out) {
+    const __m256i bits = _mm256_set1_epi64x(0x0102040810204080);
+    const __m256i spread_ctrl = _mm256_setr_epi8(
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2,
+        3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i two = _mm256_set1_epi8(2);
+
+    size_t t = 0;
+    for (; t < (count & ~(size_t)3); t += 4) {
+        int lo4, hi4;
+        memcpy(&lo4, lo + t, 4);
+        memcpy(&hi4, hi + t, 4);
+        __m256i lo_x8 =
+            _mm256_shuffle_epi8(_mm256_set1_epi32(lo4), spread_ctrl);
+        __m256i hi_x8 =
+            _mm256_shuffle_epi8(_mm256_set1_epi32(hi4), spread_ctrl);
+        __m256i lo_set =
+            _mm256_cmpeq_epi8(_mm256_and_si256(lo_x8, bits), bits);
+        __m256i hi_set =
+            _mm256_cmpeq_epi8(_mm256_and_si256(hi_x8, bits), bits);
+        __m256i pixels = _mm256_or_si256(_mm256_and_si256(lo_set, one),
+                                         _mm256_and_si256(hi_set, two));
+        _mm256_storeu_si256((__m256i*)(out + 8 * t), pixels);
+    }
+    decode_rows_scalar(lo + t, hi + t, count - t, out + 8 * t);
+}
+
+// The table fills each 16-byte lane, indexed by vpshufb
+RONDO_TARGET_AVX2
+static void apply_palette_avx2(const u8* in, size_t count, const u8* table,
+                               u8* out) {
+    const __m256i lanes = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i*)table));
+    const __m256i mask = _mm256_set1_epi8(15);
+
+    size_t i = 0;
+    for (; i < (count & ~(size_t)31); i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i result = _mm256_shuffle_epi8(lanes, _mm256_and_si256(v, mask));
+        _mm256_storeu_si256((__m256i*)(out + i), result);
+    }
+    apply_palette_scalar(in + i, count - i, table, out + i);
+}
+
+static const TileKernels AVX2_KERNELS = {"avx2", decode_rows_avx2,
+                                         apply_palette_avx2};
+
+#endif
+
+static const TileKernels* select_kernels(void) {
+    const TileKernels* kernels = &SCALAR_KERNELS;
+#if RONDO_SSE2
+    kernels = &SSE2_KERNELS;
+#endif
+#if RONDO_AVX2
+    if (cpu_has_avx2()) {
+        kernels = &AVX2_KERNELS;
+    }
+#endif
+    return kernels;
+}
+
+const TileKernels* get_tile_kernels(void) {
+    const TileKernels* kernels = load_selected();
+    if (!kernels) {
+        kernels = select_kernels();
+        store_selected(kernels);
+    }
+    return kernels;
+}
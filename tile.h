@@ -0,0 +1,20 @@
+#ifndef RONDO_TILE_H
+#define RONDO_TILE_H
+
+#include "gb.h"
+
+// Kernels for the core PPU operations, picked at runtime for the host CPU
+typedef struct TileKernels {
+    const char* name;
+    // Decode `count` 2bpp tile rows, given as separate arrays of low and high
+    // plane bytes, into 8 color indices (0-3) each, leftmost pixel first
+    void (*decode_rows)(const u8* lo, const u8* hi, size_t count, u8* out);
+    // Map `count` 4-bit PAL_CODE() values through a 16-entry table
+    void (*apply_palette)(const u8* in, size_t count, const u8* table,
+                          u8* out);
+} TileKernels;
+
+// The first call selects the kernels. Safe to call from any thread.
+const TileKernels* get_tile_kernels(void);
+
+#endif
@@ -0,0 +1,115 @@
+#include "timer.h"
+
+#include "apu.h"
+
+#define NEVER UINT64_MAX
+
+// DIV bit 12 falls every 0x2000 clocks, stepping the frame sequencer
+#define SEQ_PERIOD 0x2000
+
+// Clocks per TIMA increment for each TAC clock select. TIMA increments on
+// the falling edge of DIV bit log2(period) - 1.
+static const u16 TIMA_PERIODS[4] = {1024, 16, 64, 256};
+
+// The internal 16 bit divider, unwrapped so tick counts are plain divisions
+static u64 div_count(GameBoy* gb) { return gb->clock - gb->div_epoch; }
+
+static void update_next_event(GameBoy* gb) {
+    gb->next_event = gb->tima_overflow < gb->seq_next ? gb->tima_overflow
+                                                      : gb->seq_next;
+}
+
+// Apply the TIMA increments since the last sync. Overflows reload TMA and
+// request the timer interrupt.
+static void sync_tima(GameBoy* gb) {
+    if (gb->tac_en) {
+        u16 period = TIMA_PERIODS[gb->tac_clk];
+        u64 ticks = div_count(gb) / period -
+                    (gb->tima_sync - gb->div_epoch) / period;
+        if (gb->tima + ticks < 0x100) {
+            gb->tima += ticks;
+        } else {
+            ticks -= 0x100 - gb->tima;
+            gb->tima = gb->tma + ticks % (0x100 - gb->tma);
+            gb->if_ |= (1 << 2);
+        }
+    }
+    gb->tima_sync = gb->clock;
+}
+
+// Must follow sync_tima()
+static void schedule_overflow(GameBoy* gb) {
+    gb->tima_overflow = NEVER;
+    if (gb->tac_en) {
+        u16 period = TIMA_PERIODS[gb->tac_clk];
+        u64 tick = div_count(gb) / period + (0x100 - gb->tima);
+        gb->tima_overflow = gb->div_epoch + tick * period;
+    }
+    update_next_event(gb);
+}
+
+void init_timer(GameBoy* gb) {
+    gb->tima_overflow = NEVER;
+    gb->seq_next = gb->div_epoch + SEQ_PERIOD;
+    update_next_event(gb);
+}
+
+u8 read_div(GameBoy* gb) { return div_count(gb) >> 8; }
+
+u8 read_tima(GameBoy* gb) {
+    sync_tima(gb);
+    return gb->tima;
+}
+
+void reset_div(GameBoy* gb) {
+    sync_tima(gb);
+    // Resetting the divider while a watched bit is set is a falling edge
+    u64 count = div_count(gb);
+    if (gb->tac_en && (count & (TIMA_PERIODS[gb->tac_clk] / 2))) {
+        if (!++gb->tima) {
+            gb->tima = gb->tma;
+            gb->if_ |= (1 << 2);
+        }
+    }
+    if ((count & (SEQ_PERIOD / 2)) && gb->apu_en) {
+        div_apu_event(gb);
+    }
+
+    gb->div_epoch = gb->clock;
+    gb->tima_sync = gb->clock;
+    gb->seq_next = gb->clock + SEQ_PERIOD;
+    schedule_overflow(gb);
+}
+
+void write_tima(GameBoy* gb, u8 data) {
+    sync_tima(gb);
+    gb->tima = data;
+    schedule_overflow(gb);
+}
+
+void write_tma(GameBoy* gb, u8 data) {
+    sync_tima(gb);
+    gb->tma = data;
+    schedule_overflow(gb);
+}
+
+void write_tac(GameBoy* gb, u8 data) {
+    sync_tima(gb);
+    gb->tac_en = data & (1 << 2);
+    gb->tac_clk = data & 0x3;
+    schedule_overflow(gb);
+}
+
+void run_timer_events(GameBoy* gb) {
+    if (gb->clock >= gb->tima_overflow) {
+        sync_tima(gb);
+        schedule_overflow(gb);
+    }
+    if (gb->clock >= gb->seq_next) {
+        if (gb->apu_en) {
+            div_apu_event(gb);
+        }
+        gb->seq_next += SEQ_PERIOD;
+        update_next_event(gb);
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef RONDO_TIMER_H
+#define RONDO_TIMER_H
+
+#include "gb.h"
+
+// DIV and TIMA are not stepped every cycle. DIV is derived from gb->clock,
+// and TIMA is brought up to date only when it is accessed or overflows.
+// Overflows and frame sequencer steps are scheduled as events at the clock
+// they happen, so cycle() only compares the clock with gb->next_event.
+
+void init_timer(GameBoy* gb);
+
+// FF04-FF07, registers are read and written at the current clock
+u8 read_div(GameBoy* gb);
+u8 read_tima(GameBoy* gb);
+void reset_div(GameBoy* gb);
+void write_tima(GameBoy* gb, u8 data);
+void write_tma(GameBoy* gb, u8 data);
+void write_tac(GameBoy* gb, u8 data);
+
+// Called by cycle() once gb->clock reaches gb->next_event
+void run_timer_events(GameBoy* gb);
+
+#endif
@@ -0,0 +1,179 @@
+#include "video_log.h"
+
+#include "fbuf.h"
+#include "hash.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+// Defined in gb.c
+void* crit_alloc(size_t size);
+
+typedef struct DeferredVideo {
+    VideoLog log;
+    VideoReplay replay;
+} DeferredVideo;
+
+void init_video_replay(VideoReplay* replay, GameBoy* gb) {
+    capture_line(gb, &replay->regs);
+    memcpy(replay->vram, gb->vram, sizeof(replay->vram));
+    memcpy(replay->oam, gb->oam, sizeof(replay->oam));
+    replay->format = gb->fbuf_format;
+    replay->lcd_en = gb->lcd_en;
+}
+
+static void set_palette(VideoReplay* replay, PaletteId pal, u8 data) {
+    for (u8 color = 0; color < 4; color++) {
+        replay->regs.pal_lut[PAL_CODE(pal, color)] =
+            fbuf_pixel(replay->format, (data >> (2 * color)) & 0x3);
+    }
+}
+
+static void apply_write(VideoReplay* replay, const LoggedWrite* w) {
+    LineState* regs = &replay->regs;
+    if (w->addr < 0xA000) {
+        replay->vram[w->addr % 0x2000] = w->data;
+        return;
+    }
+    if (w->addr < 0xFF00) {
+        replay->oam[w->addr & 0xFF] = w->data;
+        return;
+    }
+
+    switch (w->addr & 0xFF) {
+    case 0x40: // LCDC (FF40)
+        replay->lcd_en = w->data & (1 << 7);
+        regs->win_map = w->data & (1 << 6);
+        regs->win_en = w->data & (1 << 5);
+        regs->tile_sel = w->data & (1 << 4);
+        regs->bg_map = w->data & (1 << 3);
+        regs->obj_size = w->data & (1 << 2);
+        regs->obj_en = w->data & (1 << 1);
+        regs->bg_en = w->data & (1 << 0);
+        break;
+    case 0x42: // SCY (FF42)
+        regs->scy = w->data;
+        break;
+    case 0x43: // SCX (FF43)
+        regs->scx = w->data;
+        break;
+    case 0x47: // BGP (FF47)
+        set_palette(replay, PAL_BG, w->data);
+        break;
+    case 0x48: // OBP0 (FF48)
+        set_palette(replay, PAL_OBP0, w->data);
+        break;
+    case 0x49: // OBP1 (FF49)
+        set_palette(replay, PAL_OBP1, w->data);
+        break;
+    case 0x4A: // WY (FF4A)
+        regs->wy = w->data;
+        break;
+    case 0x4B: // WX (FF4B)
+        regs->wx = w->data;
+        break;
+    default:
+        // STAT, LY and LYC don't change what is drawn
+        break;
+    }
+}
+
+void replay_video_log(VideoReplay* replay, const VideoLog* log, void* fbuf,
+                      bool draw) {
+    // Turning the LCD on restarts the frame at line 0 and time -80, so lines
+    // drawn before that are drawn again. Only the writes after the last
+    // restart are timed against the lines.
+    size_t restart = 0;
+    bool lcd_en = replay->lcd_en;
+    for (size_t j = 0; j < log->count; j++) {
+        if (log->writes[j].addr == 0xFF40) {
+            bool on = log->writes[j].data & (1 << 7);
+            if (on && !lcd_en) {
+                restart = j + 1;
+            }
+            lcd_en = on;
+        }
+    }
+    size_t i = 0;
+    for (; i < restart; i++) {
+        apply_write(replay, &log->writes[i]);
+    }
+
+    if (draw) {
+        for (u8 y = 0; y < SCREEN_HEIGHT; y++) {
+            // Lines are drawn whole as they start, at time y * 456
+            s32 start = y * 456;
+            for (; i < log->count && log->writes[i].time < start; i++) {
+                apply_write(replay, &log->writes[i]);
+            }
+            replay->regs.ly = y;
+            if (y == 0) {
+                replay->regs.win_line = 0;
+                replay->regs.wy_hit = false;
+            }
+            if (y == replay->regs.wy) {
+                replay->regs.wy_hit = true;
+            }
+            if (draw_line(&replay->regs, replay->vram, replay->oam, fbuf,
+                          replay->format)) {
+                replay->regs.win_line++;
+            }
+        }
+    }
+    for (; i < log->count; i++) {
+        apply_write(replay, &log->writes[i]);
+    }
+}
+
+void log_video_write(GameBoy* gb, u16 addr, u8 data) {
+    VideoLog* log = gb->video_log;
+    if (log->count == log->capacity) {
+        size_t capacity = log->capacity ? log->capacity * 2 : 4096;
+        LoggedWrite* writes = realloc(log->writes, capacity * sizeof(*writes));
+        if (!writes) {
+            printf("Memory allocation failed!");
+            exit(1);
+        }
+        log->writes = writes;
+        log->capacity = capacity;
+    }
+    log->writes[log->count++] = (LoggedWrite){lcd_frame_time(gb), addr, data};
+}
+
+void destroy_video_log(VideoLog* log) {
+    free(log->writes);
+    log->writes = NULL;
+    log->count = log->capacity = 0;
+}
+
+void start_deferred_video(GameBoy* gb) {
+    if (gb->deferred_video || gb->render_thread ||
+        gb->ppu_backend == PPU_FIFO) {
+        return;
+    }
+    DeferredVideo* deferred = crit_alloc(sizeof(DeferredVideo));
+    init_video_replay(&deferred->replay, gb);
+    gb->deferred_video = deferred;
+    gb->video_log = &deferred->log;
+}
+
+void stop_deferred_video(GameBoy* gb) {
+    DeferredVideo* deferred = gb->deferred_video;
+    if (!deferred) {
+        return;
+    }
+    destroy_video_log(&deferred->log);
+    free(deferred);
+    gb->deferred_video = NULL;
+    gb->video_log = NULL;
+}
+
+void draw_deferred_frame(GameBoy* gb) {
+    DeferredVideo* deferred = gb->deferred_video;
+    bool draw = !gb->skip_video;
+    replay_video_log(&deferred->replay, &deferred->log, gb->fbuf, draw);
+    deferred->log.count = 0;
+    if (draw && gb->hash_video) {
+        gb->frame_hash = hash_fbuf(gb);
+    }
+}
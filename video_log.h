@@ -0,0 +1,54 @@
+#ifndef RONDO_VIDEO_LOG_H
+#define RONDO_VIDEO_LOG_H
+
+#include "gb.h"
+#include "lcd.h"
+
+// Deferred drawing. Instead of drawing each line as the LCD reaches it, every
+// write that can change the picture (VRAM, OAM and LCD registers FF40-FF4B)
+// is logged with the time it happened. At V-Blank the log is replayed against
+// a copy of VRAM, OAM and the registers taken at the start of the frame,
+// drawing each line once all writes made before it started have been applied.
+
+typedef struct {
+    s32 time; // See lcd_frame_time()
+    u16 addr;
+    u8 data;
+} LoggedWrite;
+
+typedef struct VideoLog {
+    LoggedWrite* writes;
+    size_t count;
+    size_t capacity;
+} VideoLog;
+
+// The LCD's view of the machine as of the end of the last replayed frame
+typedef struct VideoReplay {
+    LineState regs;
+    u8 vram[0x2000];
+    u8 oam[0xA0];
+    FBufFormat format;
+    bool lcd_en; // LCDC bit 7, turning it on restarts the frame
+} VideoReplay;
+
+// Start the replay from gb's current state
+void init_video_replay(VideoReplay* replay, GameBoy* gb);
+// Apply every write in the log, drawing all lines into fbuf if draw is set
+void replay_video_log(VideoReplay* replay, const VideoLog* log, void* fbuf,
+                      bool draw);
+
+// Append to gb->video_log, stamped with the current time
+void log_video_write(GameBoy* gb, u16 addr, u8 data);
+void destroy_video_log(VideoLog* log);
+
+// Single-threaded deferred drawing: the frame is drawn into gb->fbuf in one
+// pass when V-Blank starts. See render_thread.h for drawing on a second
+// thread instead. Does nothing with the FIFO PPU backend. The libretro core
+// turns it on with the rondo_video option. set_fbuf_format() starts it over.
+void start_deferred_video(GameBoy* gb);
+// Does nothing if deferred drawing is off
+void stop_deferred_video(GameBoy* gb);
+// Called by ldc.c at the start of V-Blank
+void draw_deferred_frame(GameBoy* gb);
+
+#endif